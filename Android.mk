@@ -64,6 +64,6 @@ LOCAL_MODULE    := teapotnet
 LOCAL_CFLAGS    := -DHAVE_PTHREADS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS
 LOCAL_SRC_FILES := $(wildcard $(LOCAL_PATH)/pla/*.cpp) $(wildcard $(LOCAL_PATH)/tpn/*.cpp) include/sqlite3.c
 LOCAL_C_INCLUDES := $(CERBERO)/include $(HOME)/src/argon2/include
-LOCAL_LDLIBS    := -llog
+LOCAL_LDLIBS    := -llog -lz
 LOCAL_STATIC_LIBRARIES := gnutls nettle hogweed gmp tasn1 intl iconv z argon2
 include $(BUILD_SHARED_LIBRARY)
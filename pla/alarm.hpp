@@ -117,7 +117,7 @@ auto Alarm::schedule(time_point time, F&& f, Args&&... args)
 	std::future<type> result = task->get_future();
 
 	if(joining) throw std::runtime_error("schedule on closing Alarm");
-	scheduler.schedule(taskid, time, function = [task]()
+	scheduler.arm(taskid, time, function = [task]()
 	{
 		(*task)();
 		task->reset();
@@ -136,7 +136,7 @@ auto Alarm::schedule(duration d, F&& f, Args&&... args)
 inline void Alarm::schedule(time_point time)
 {
 	if(joining) throw std::runtime_error("schedule on closing Alarm");
-	scheduler.schedule(taskid, time, function);
+	scheduler.arm(taskid, time, function);	// no future, re-arming is cheap
 }
 
 inline void Alarm::schedule(duration d)
@@ -70,11 +70,31 @@ BinaryString::BinaryString(const BinaryString &str, int begin, int end) :
 
 }
 
+BinaryString::BinaryString(BinaryString &&str) :
+		std::string(std::move(str))
+{
+
+}
+
 BinaryString::~BinaryString(void)
 {
 
 }
 
+BinaryString &BinaryString::operator= (const BinaryString &str)
+{
+	std::string::operator=(str);
+	Stream::operator=(str);
+	return *this;
+}
+
+BinaryString &BinaryString::operator= (BinaryString &&str)
+{
+	Stream::operator=(str);
+	std::string::operator=(std::move(str));
+	return *this;
+}
+
 char *BinaryString::ptr(void)
 {
 	return reinterpret_cast<char*>(&at(0));
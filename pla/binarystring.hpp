@@ -46,9 +46,13 @@ public:
 	BinaryString(size_t n, char chr);
 	BinaryString(const BinaryString &str, int begin = 0);
 	BinaryString(const BinaryString &str, int begin, int end);
+	BinaryString(BinaryString &&str);
 	template<class InputIterator> BinaryString(InputIterator first, InputIterator last) : std::string(first, last) {}
 	virtual ~BinaryString(void);
 
+	BinaryString &operator= (const BinaryString &str);
+	BinaryString &operator= (BinaryString &&str);
+
 	// Access
 	// Prefer data() for standard read-only access
 	char *ptr(void);
@@ -0,0 +1,238 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2017 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of Plateform.                                     *
+ *                                                                       *
+ *   Plateform is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   Plateform is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with Plateform.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#include "pla/budget.hpp"
+#include "pla/object.hpp"
+#include "pla/serializer.hpp"
+#include "pla/exception.hpp"
+
+namespace pla
+{
+
+std::atomic<uint64_t> Budget::GlobalLimit(0);
+std::atomic<uint64_t> Budget::GlobalUsage(0);
+
+void Budget::SetLimit(uint64_t limit)
+{
+	GlobalLimit = limit;
+}
+
+uint64_t Budget::Limit(void)
+{
+	return GlobalLimit;
+}
+
+uint64_t Budget::Usage(void)
+{
+	return GlobalUsage;
+}
+
+bool Budget::IsExhausted(void)
+{
+	uint64_t limit = GlobalLimit;
+	return limit && GlobalUsage >= limit;
+}
+
+Set<Budget::Account*> &Budget::Accounts(void)
+{
+	static Set<Account*> accounts;
+	return accounts;
+}
+
+std::mutex &Budget::AccountsMutex(void)
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+Budget::Account::Account(const String &name, uint64_t limit, uint64_t peerLimit) :
+	mName(name),
+	mLimit(limit),
+	mPeerLimit(peerLimit),
+	mUsage(0),
+	mRejected(0)
+{
+	std::unique_lock<std::mutex> lock(AccountsMutex());
+	Accounts().insert(this);
+}
+
+Budget::Account::~Account(void)
+{
+	{
+		std::unique_lock<std::mutex> lock(AccountsMutex());
+		Accounts().erase(this);
+	}
+
+	GlobalUsage-= std::min(uint64_t(GlobalUsage), mUsage);
+}
+
+String Budget::Account::name(void) const
+{
+	return mName;
+}
+
+uint64_t Budget::Account::usage(void) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mUsage;
+}
+
+uint64_t Budget::Account::usage(const String &peer) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	uint64_t bytes = 0;
+	mPeers.get(peer, bytes);
+	return bytes;
+}
+
+bool Budget::Account::isExhausted(void) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return (mLimit && mUsage >= mLimit) || Budget::IsExhausted();
+}
+
+void Budget::Account::setLimits(uint64_t limit, uint64_t peerLimit)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mLimit = limit;
+	mPeerLimit = peerLimit;
+}
+
+bool Budget::Account::acquire(uint64_t bytes, const String &peer)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	bool allowed = !mLimit || mUsage + bytes <= mLimit;
+
+	if(allowed && mPeerLimit && !peer.empty())
+	{
+		uint64_t peerUsage = 0;
+		mPeers.get(peer, peerUsage);
+		allowed = (peerUsage + bytes <= mPeerLimit);
+	}
+
+	if(allowed)
+	{
+		// Reserve globally first, other accounts compete for the same limit
+		uint64_t limit = GlobalLimit;
+		uint64_t previous = GlobalUsage.fetch_add(bytes);
+		if(limit && previous + bytes > limit)
+		{
+			GlobalUsage-= bytes;
+			allowed = false;
+		}
+	}
+
+	if(!allowed)
+	{
+		++mRejected;
+		return false;
+	}
+
+	add(bytes, peer);
+	return true;
+}
+
+void Budget::Account::charge(uint64_t bytes, const String &peer)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	GlobalUsage+= bytes;
+	add(bytes, peer);
+}
+
+void Budget::Account::release(uint64_t bytes, const String &peer)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	if(!peer.empty())
+	{
+		auto it = mPeers.find(peer);
+		if(it != mPeers.end())
+		{
+			it->second-= std::min(it->second, bytes);
+			if(!it->second) mPeers.erase(it);
+		}
+	}
+
+	bytes = std::min(bytes, mUsage);
+	mUsage-= bytes;
+	GlobalUsage-= bytes;
+}
+
+void Budget::Account::add(uint64_t bytes, const String &peer)
+{
+	// Must be called with mMutex locked
+	mUsage+= bytes;
+	if(!peer.empty())
+	{
+		auto it = mPeers.find(peer);
+		if(it != mPeers.end()) it->second+= bytes;
+		else mPeers.insert(peer, bytes);
+	}
+}
+
+void Budget::Account::serialize(Serializer &s) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	s << Object()
+		.insert("usage", mUsage)
+		.insert("limit", mLimit)
+		.insert("peer_limit", mPeerLimit)
+		.insert("rejected", mRejected)
+		.insert("peers", mPeers);
+}
+
+bool Budget::Account::deserialize(Serializer &s)
+{
+	throw Unsupported("Budget::Account::deserialize");
+}
+
+bool Budget::Account::isInlineSerializable(void) const
+{
+	return false;
+}
+
+void Budget::Statistics::serialize(Serializer &s) const
+{
+	std::unique_lock<std::mutex> lock(AccountsMutex());
+
+	Object accounts;
+	for(const Account *account : Accounts())
+		accounts.insert(account->name(), *account);
+
+	s << Object()
+		.insert("usage", uint64_t(GlobalUsage))
+		.insert("limit", uint64_t(GlobalLimit))
+		.insert("accounts", accounts);
+}
+
+bool Budget::Statistics::deserialize(Serializer &s)
+{
+	throw Unsupported("Budget::Statistics::deserialize");
+}
+
+bool Budget::Statistics::isInlineSerializable(void) const
+{
+	return false;
+}
+
+}
@@ -0,0 +1,102 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2017 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of Plateform.                                     *
+ *                                                                       *
+ *   Plateform is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   Plateform is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with Plateform.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#ifndef PLA_BUDGET_H
+#define PLA_BUDGET_H
+
+#include "pla/include.hpp"
+#include "pla/serializable.hpp"
+#include "pla/string.hpp"
+#include "pla/map.hpp"
+#include "pla/set.hpp"
+
+#include <atomic>
+
+namespace pla
+{
+
+// Memory accounting for buffers filled by remote peers
+class Budget
+{
+public:
+	// Subsystem account, a limit of 0 means only the global limit applies
+	class Account : public Serializable
+	{
+	public:
+		Account(const String &name, uint64_t limit = 0, uint64_t peerLimit = 0);
+		~Account(void);
+
+		String name(void) const;
+		uint64_t usage(void) const;
+		uint64_t usage(const String &peer) const;
+		bool isExhausted(void) const;
+
+		void setLimits(uint64_t limit, uint64_t peerLimit = 0);
+
+		bool acquire(uint64_t bytes, const String &peer = "");	// fails if a limit would be crossed
+		void charge(uint64_t bytes, const String &peer = "");	// never fails, for buffers that can't be refused
+		void release(uint64_t bytes, const String &peer = "");
+
+		// Serializable
+		void serialize(Serializer &s) const;
+		bool deserialize(Serializer &s);
+		bool isInlineSerializable(void) const;
+
+	private:
+		void add(uint64_t bytes, const String &peer);
+
+		String mName;
+		uint64_t mLimit;
+		uint64_t mPeerLimit;
+		uint64_t mUsage;
+		uint64_t mRejected;
+		Map<String, uint64_t> mPeers;
+		mutable std::mutex mMutex;
+	};
+
+	// Snapshot of all accounts, serialized on demand
+	class Statistics : public Serializable
+	{
+	public:
+		void serialize(Serializer &s) const;
+		bool deserialize(Serializer &s);
+		bool isInlineSerializable(void) const;
+	};
+
+	static void SetLimit(uint64_t limit);
+	static uint64_t Limit(void);
+	static uint64_t Usage(void);
+	static bool IsExhausted(void);
+
+private:
+	static std::atomic<uint64_t> GlobalLimit;
+	static std::atomic<uint64_t> GlobalUsage;
+
+	// Accounts are usually static objects, so the registry is built on first use
+	static Set<Account*> &Accounts(void);
+	static std::mutex &AccountsMutex(void);
+
+	Budget(void);
+};
+
+}
+
+#endif
@@ -1056,6 +1056,29 @@ void Rsa::SignCertificate(gnutls_x509_crt_t crt, gnutls_x509_crt_t issuer, gnutl
 unsigned Argon2::DefaultTimeCost = 3;				// 3 pass
 unsigned Argon2::DefaultMemoryCost = 1<<16; // 64 MiB
 unsigned Argon2::DefaultParallelism = 2;		// 2 threads
+const size_t Argon2::MaxCachedKeys = 64;
+
+Map<BinaryString, BinaryString> Argon2::CachedKeys;
+List<BinaryString> Argon2::CachedKeysOrder;
+BinaryString Argon2::CacheMacKey;
+std::mutex Argon2::CacheMutex;
+
+void Argon2::ClearCache(void)
+{
+	std::unique_lock<std::mutex> lock(CacheMutex);
+	for(auto &p : CachedKeys)
+		Zeroize(p.second);
+
+	CachedKeys.clear();
+	CachedKeysOrder.clear();
+}
+
+void Argon2::Zeroize(BinaryString &str)
+{
+	volatile char *p = &str[0];
+	for(size_t i = 0; i < str.size(); ++i)
+		p[i] = 0;
+}
 
 Argon2::Argon2(void) :
 	mTimeCost(DefaultTimeCost),
@@ -1091,6 +1114,58 @@ void Argon2::compute(const BinaryString &secret, const BinaryString &salt, Binar
 	compute(secret.data(), secret.size(), salt.data(), salt.size(), key.ptr(), key.size());
 }
 
+void Argon2::computeCached(const BinaryString &secret, const BinaryString &salt, BinaryString &key, size_t key_len)
+{
+	BinaryString message;
+	BinarySerializer serializer(&message);
+	serializer << uint32_t(mTimeCost) << uint32_t(mMemoryCost) << uint32_t(mParallelism) << uint32_t(key_len);
+	serializer << secret << salt;
+
+	BinaryString index;
+	{
+		std::unique_lock<std::mutex> lock(CacheMutex);
+		if(CacheMacKey.empty())
+		{
+			CacheMacKey.resize(32);
+			Random(Random::Key).generate(CacheMacKey.ptr(), CacheMacKey.size());
+		}
+
+		Sha256().mac(message, CacheMacKey, index);
+
+		auto it = CachedKeys.find(index);
+		if(it != CachedKeys.end())
+		{
+			key = it->second;
+			CachedKeysOrder.remove(index);
+			CachedKeysOrder.push_back(index);
+			Zeroize(message);
+			return;
+		}
+	}
+
+	// Compute without holding the lock
+	compute(secret, salt, key, key_len);
+	Zeroize(message);
+
+	std::unique_lock<std::mutex> lock(CacheMutex);
+	if(!CachedKeys.contains(index))
+	{
+		CachedKeys.insert(index, key);
+		CachedKeysOrder.push_back(index);
+	}
+
+	while(CachedKeysOrder.size() > MaxCachedKeys)
+	{
+		auto it = CachedKeys.find(CachedKeysOrder.front());
+		if(it != CachedKeys.end())
+		{
+			Zeroize(it->second);
+			CachedKeys.erase(it);
+		}
+		CachedKeysOrder.pop_front();
+	}
+}
+
 size_t mpz_size_binary(const mpz_t n)
 {
 	return (mpz_sizeinbase(n, 2) + 7) / 8;
@@ -26,6 +26,8 @@
 #include "pla/binarystring.hpp"
 #include "pla/string.hpp"
 #include "pla/stream.hpp"
+#include "pla/map.hpp"
+#include "pla/list.hpp"
 
 #include <nettle/sha1.h>
 #include <nettle/sha2.h>
@@ -374,6 +376,9 @@ public:
 	static unsigned DefaultTimeCost;
 	static unsigned DefaultMemoryCost;
 	static unsigned DefaultParallelism;
+	static const size_t MaxCachedKeys;
+
+	static void ClearCache(void);
 
 	Argon2(void);
 	Argon2(unsigned tcost, unsigned mcost, unsigned parallelism);
@@ -382,7 +387,18 @@ public:
 	void compute(const char *secret, size_t len, const char *salt, size_t salt_len, char *key, size_t key_len);
 	void compute(const BinaryString &secret, const BinaryString &salt, BinaryString &key, size_t key_len);
 
+	// Same as compute() but derived keys are kept in a bounded in-memory cache
+	void computeCached(const BinaryString &secret, const BinaryString &salt, BinaryString &key, size_t key_len);
+
 private:
+	static void Zeroize(BinaryString &str);
+
+	// Cache entries are indexed by a keyed hash of parameters, secret and salt
+	static Map<BinaryString, BinaryString> CachedKeys;
+	static List<BinaryString> CachedKeysOrder;	// least recently used first
+	static BinaryString CacheMacKey;
+	static std::mutex CacheMutex;
+
 	unsigned mTimeCost;
 	unsigned mMemoryCost;
 	unsigned mParallelism;
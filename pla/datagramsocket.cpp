@@ -28,15 +28,19 @@ namespace pla
 {
 
 const size_t DatagramSocket::MaxDatagramSize = 1500;
+const unsigned DatagramSocket::RecvBatchSize = 32;
+const unsigned DatagramSocket::MaxPending = 1024;
 
 DatagramSocket::DatagramSocket(int port, bool broadcast) :
-		mSock(INVALID_SOCKET)
+		mSock(INVALID_SOCKET),
+		mBuffers(new char[RecvBatchSize*MaxDatagramSize])
 {
 	bind(port, broadcast);
 }
 
 DatagramSocket::DatagramSocket(const Address &local, bool broadcast) :
-		mSock(INVALID_SOCKET)
+		mSock(INVALID_SOCKET),
+		mBuffers(new char[RecvBatchSize*MaxDatagramSize])
 {
 	bind(local, broadcast);
 }
@@ -44,6 +48,7 @@ DatagramSocket::DatagramSocket(const Address &local, bool broadcast) :
 DatagramSocket::~DatagramSocket(void)
 {
 	NOEXCEPTION(close());
+	delete[] mBuffers;
 }
 
 Address DatagramSocket::getBindAddress(void) const
@@ -322,6 +327,12 @@ void DatagramSocket::bind(const Address &local, bool broadcast)
 
 void DatagramSocket::close(void)
 {
+	{
+		std::unique_lock<std::mutex> lock(mRecvMutex);
+		while(!mPending.empty())
+			popPending(mPending.front().data.size());
+	}
+
 	std::unique_lock<std::mutex> lock(mStreamsMutex);
 
 	for(auto it = mStreams.begin(); it != mStreams.end(); ++it)
@@ -410,50 +421,144 @@ int DatagramSocket::recv(char *buffer, size_t size, Address &sender, duration ti
 	if(timeout >= duration::zero()) end = clock::now() + std::chrono::duration_cast<clock::duration>(timeout);
 	else end = std::chrono::time_point<clock>::max();
 
-	do {
-		duration left = end - std::chrono::steady_clock::now();
-		if(!wait(left)) break;
-
-		char datagramBuffer[MaxDatagramSize];
-		sockaddr_storage sa;
-		socklen_t sl = sizeof(sa);
-		int result = ::recvfrom(mSock, datagramBuffer, MaxDatagramSize, flags | MSG_PEEK, reinterpret_cast<sockaddr*>(&sa), &sl);
-		if(result < 0) throw NetException("Unable to read from socket (error " + String::number(sockerrno) + ")");
-		sender.set(reinterpret_cast<sockaddr*>(&sa),sl);
+	std::unique_lock<std::mutex> lock(mRecvMutex);
 
-		std::unique_lock<std::mutex> lock(mStreamsMutex);
-		auto it = mStreams.find(sender.unmap());
-		if(it == mStreams.end())
+	while(true)
+	{
+		// Datagrams from unmapped senders are kept until read, in case a stream is mapped in between
+		while(!mPending.empty())
 		{
-			size = std::min(result, int(size));
-			std::memcpy(buffer, datagramBuffer, size);
+			Datagram &datagram = mPending.front();
+			const size_t charged = datagram.data.size();	// data is moved when dispatched
+			if(dispatch(datagram))
+			{
+				popPending(charged);
+				continue;
+			}
+
+			sender = datagram.sender;
+			size = std::min(size, datagram.data.size());
+			std::memcpy(buffer, datagram.data.data(), size);
 
 			if(!(flags & MSG_PEEK))
-				::recvfrom(mSock, datagramBuffer, MaxDatagramSize, flags, reinterpret_cast<sockaddr*>(&sa), &sl);
-			return size;
+				popPending(charged);
+			return int(size);
 		}
 
-		BinaryString tmp(datagramBuffer, size_t(result));
-		for(auto jt = it->second.begin(); jt != it->second.end(); ++jt)
+		duration left = std::max(duration(end - std::chrono::steady_clock::now()), duration::zero());
+		lock.unlock();
+		bool ready = wait(left);
+		lock.lock();
+		if(!ready) break;
+
+		receive();
+
+		if(mPending.empty() && std::chrono::steady_clock::now() > end)
+			break;
+	}
+
+	return -1;
+}
+
+void DatagramSocket::receive(void)
+{
+	// Must be called with mRecvMutex locked
+#if defined(LINUX) && !defined(ANDROID)
+	// Receive a whole batch in one call
+	mmsghdr msgs[RecvBatchSize];
+	iovec iovs[RecvBatchSize];
+	sockaddr_storage addrs[RecvBatchSize];
+	std::memset(msgs, 0, sizeof(msgs));
+	for(unsigned i = 0; i < RecvBatchSize; ++i)
+	{
+		iovs[i].iov_base = mBuffers + i*MaxDatagramSize;
+		iovs[i].iov_len = MaxDatagramSize;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+
+	int count = ::recvmmsg(mSock, msgs, RecvBatchSize, MSG_DONTWAIT, NULL);
+	if(count < 0)
+	{
+		if(sockerrno == SEAGAIN || sockerrno == SEWOULDBLOCK || sockerrno == EINTR) return;
+		throw NetException("Unable to read from socket (error " + String::number(sockerrno) + ")");
+	}
+
+	for(int i = 0; i < count; ++i)
+	{
+		Datagram datagram;
+		datagram.sender.set(reinterpret_cast<sockaddr*>(&addrs[i]), msgs[i].msg_hdr.msg_namelen);
+		datagram.data.assign(mBuffers + i*MaxDatagramSize, std::min(size_t(msgs[i].msg_len), MaxDatagramSize));
+
+		if(!dispatch(datagram))
+			pushPending(datagram);
+	}
+#else
+	sockaddr_storage sa;
+	socklen_t sl = sizeof(sa);
+	int result = ::recvfrom(mSock, mBuffers, MaxDatagramSize, 0, reinterpret_cast<sockaddr*>(&sa), &sl);
+	if(result < 0) throw NetException("Unable to read from socket (error " + String::number(sockerrno) + ")");
+
+	Datagram datagram;
+	datagram.sender.set(reinterpret_cast<sockaddr*>(&sa), sl);
+	datagram.data.assign(mBuffers, size_t(result));
+
+	if(!dispatch(datagram))
+		pushPending(datagram);
+#endif
+}
+
+bool DatagramSocket::dispatch(Datagram &datagram)
+{
+	std::unique_lock<std::mutex> lock(mStreamsMutex);
+	auto it = mStreams.find(datagram.sender.unmap());
+	if(it == mStreams.end())
+		return false;
+
+	// Copy only if several streams are mapped, the last one gets the datagram moved
+	size_t remaining = it->second.size();
+	for(auto jt = it->second.begin(); jt != it->second.end(); ++jt)
+	{
+		DatagramStream *stream = *jt;
+		Assert(stream);
+
 		{
-			DatagramStream *stream = *jt;
-			Assert(stream);
+			std::unique_lock<std::mutex> lock(stream->mMutex);
 
+			// Datagrams over budget are dropped like on a full queue
+			if(stream->mIncoming.size() < DatagramStream::MaxQueueSize
+				&& DatagramStream::IncomingAccount.acquire(datagram.data.size(), stream->mPeer))
 			{
-				std::unique_lock<std::mutex> lock(stream->mMutex);
-
-				if(stream->mIncoming.size() < DatagramStream::MaxQueueSize)
-					stream->mIncoming.push(tmp);
+				if(--remaining) stream->mIncoming.push(datagram.data);
+				else stream->mIncoming.push(std::move(datagram.data));
 			}
-
-			stream->mCondition.notify_all();
+			else --remaining;
 		}
 
-		::recvfrom(mSock, datagramBuffer, MaxDatagramSize, flags & ~MSG_PEEK, reinterpret_cast<sockaddr*>(&sa), &sl);
+		stream->mCondition.notify_all();
 	}
-	while(std::chrono::steady_clock::now() <= end);
 
-	return -1;
+	return true;
+}
+
+void DatagramSocket::pushPending(Datagram &datagram)
+{
+	// Must be called with mRecvMutex locked
+	// Datagrams over capacity or budget are dropped like on a full stream queue
+	if(mPending.size() >= MaxPending
+		|| !DatagramStream::IncomingAccount.acquire(datagram.data.size(), datagram.sender.toString()))
+		return;
+
+	mPending.push(std::move(datagram));
+}
+
+void DatagramSocket::popPending(size_t charged)
+{
+	// Must be called with mRecvMutex locked
+	DatagramStream::IncomingAccount.release(charged, mPending.front().sender.toString());
+	mPending.pop();
 }
 
 void DatagramSocket::send(const char *buffer, size_t size, const Address &receiver, int flags)
@@ -472,6 +577,7 @@ void DatagramSocket::accept(DatagramStream &stream)
 
 	stream.mSock = this;
 	stream.mAddr = sender;
+	stream.mPeer = sender.toString();
 	std::swap(stream.mBuffer, buffer);
 }
 
@@ -497,6 +603,7 @@ void DatagramSocket::unregisterStream(DatagramStream *stream)
 
 duration DatagramStream::DefaultTimeout = seconds(60.);
 int DatagramStream::MaxQueueSize = 100;
+Budget::Account DatagramStream::IncomingAccount("datagram");
 
 DatagramStream::DatagramStream(void) :
 	mSock(NULL),
@@ -509,6 +616,7 @@ DatagramStream::DatagramStream(void) :
 DatagramStream::DatagramStream(DatagramSocket *sock, const Address &addr) :
 	mSock(sock),
 	mAddr(addr),
+	mPeer(addr.toString()),
 	mOffset(0),
 	mTimeout(DefaultTimeout)
 {
@@ -578,6 +686,7 @@ bool DatagramStream::nextRead(void)
 	std::unique_lock<std::mutex> lock(mMutex);
 
 	if(mIncoming.empty()) return false;
+	IncomingAccount.release(mIncoming.front().size(), mPeer);
 	mIncoming.pop();
 	mOffset = 0;
 	return true;
@@ -596,7 +705,11 @@ void DatagramStream::close(void)
 
 	if(mSock)
 	{
-		while(!mIncoming.empty()) mIncoming.pop();
+		while(!mIncoming.empty())
+		{
+			IncomingAccount.release(mIncoming.front().size(), mPeer);
+			mIncoming.pop();
+		}
 		mSock->unregisterStream(this);
 		mSock = NULL;
 	}
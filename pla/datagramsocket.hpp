@@ -27,6 +27,7 @@
 #include "pla/stream.hpp"
 #include "pla/set.hpp"
 #include "pla/map.hpp"
+#include "pla/budget.hpp"
 
 namespace pla
 {
@@ -37,6 +38,8 @@ class DatagramSocket
 {
 public:
 	static const size_t MaxDatagramSize;
+	static const unsigned RecvBatchSize;
+	static const unsigned MaxPending;	// datagrams from unmapped senders kept until read
 
 	DatagramSocket(int port = 0, bool broadcast = false);
 	DatagramSocket(const Address &local, bool broadcast = false);
@@ -65,8 +68,18 @@ public:
 	void unregisterStream(DatagramStream *stream);
 
 private:
+	struct Datagram
+	{
+		Address sender;
+		BinaryString data;
+	};
+
 	int recv(char *buffer, size_t size, Address &sender, duration timeout, int flags);
 	void send(const char *buffer, size_t size, const Address &receiver, int flags);
+	void receive(void);			// receive a batch of datagrams
+	bool dispatch(Datagram &datagram);	// move datagram to mapped streams
+	void pushPending(Datagram &datagram);	// charged to DatagramStream::IncomingAccount
+	void popPending(size_t charged);
 
 	socket_t mSock;
 	int mPort;
@@ -74,6 +87,11 @@ private:
 	// Mapped streams
 	Map<Address, Set<DatagramStream*> > mStreams;
 	std::mutex mStreamsMutex;
+
+	// Receive buffers and datagrams from unmapped senders
+	char *mBuffers;
+	Queue<Datagram> mPending;
+	std::mutex mRecvMutex;
 };
 
 class DatagramStream : public Stream
@@ -81,6 +99,7 @@ class DatagramStream : public Stream
 public:
 	static duration DefaultTimeout;
 	static int MaxQueueSize;
+	static Budget::Account IncomingAccount;	// bytes waiting in incoming queues
 
 	DatagramStream(void);
 	DatagramStream(DatagramSocket *sock, const Address &addr);
@@ -103,6 +122,7 @@ public:
 private:
 	DatagramSocket *mSock;
 	Address mAddr;
+	String mPeer;		// accounting key for mAddr
 	BinaryString mBuffer;
 	Queue<BinaryString> mIncoming;
 	size_t mOffset;
@@ -31,6 +31,8 @@ namespace pla
 String Http::UserAgent = "unknown";
 duration Http::ConnectTimeout = seconds(10.);
 duration Http::RequestTimeout = seconds(10.);
+duration Http::KeepAliveTimeout = seconds(5.);
+unsigned Http::MaxKeepAliveRequests = 100;
 
 Http::Request::Request(void)
 {
@@ -414,7 +416,7 @@ void Http::Request::recv(Stream *stream, bool parsePost)
 void Http::Request::clear(void)
 {
 	method = "GET";
-	version = "1.0";	// 1.1 requires chunked transfer encoding to be implemented
+	version = "1.0";	// 1.1 would require decoding chunked responses in Response::recv
 	url.clear();
 	headers.clear();
 	cookies.clear();
@@ -422,6 +424,11 @@ void Http::Request::clear(void)
 	post.clear();
 	fullUrl.clear();
 
+	deadline = Alarm::time_point::min();
+	parked = false;
+	resumed = false;
+	expired = false;
+
 	for(Map<String, TempFile*>::iterator it = files.begin(); it != files.end(); ++it)
 	 	delete it->second;
 
@@ -475,6 +482,33 @@ bool Http::Request::extractRange(int64_t &rangeBegin, int64_t &rangeEnd, int64_t
 	return false;
 }
 
+bool Http::Request::park(Waiter &waiter, duration timeout)
+{
+	if(!resume || expired) return false;	// not served by Http::Server or timed out
+
+	if(deadline == Alarm::time_point::min())
+		deadline = Alarm::clock::now() + timeout;
+
+	parked = true;
+	waiter.add(session, resume);
+	return true;
+}
+
+bool Http::Request::isParked(void) const
+{
+	return parked;
+}
+
+bool Http::Request::isResumed(void) const
+{
+	return resumed;
+}
+
+bool Http::Request::isExpired(void) const
+{
+	return expired;
+}
+
 Http::Response::Response(int code)
 {
 	clear();
@@ -506,7 +540,10 @@ void Http::Response::send(Stream *stream)
 	Assert(stream);
 	this->stream = stream;
 
-	if(version == "1.1" && code >= 200 && !headers.contains("Connexion"))
+	Connection *connection = dynamic_cast<Connection*>(stream);
+	bool chunked = false;
+	if(connection) chunked = connection->prepare(*this);
+	else if(version == "1.1" && code >= 200 && !headers.contains("Connection"))
 		headers["Connection"] = "close";
 
 	if(!headers.contains("Date"))
@@ -577,6 +614,8 @@ void Http::Response::send(Stream *stream)
 
 	buf<<"\r\n";
 	*stream<<buf;
+
+	if(chunked) connection->setChunked(true);
 }
 
 void Http::Response::recv(Stream *stream)
@@ -630,6 +669,224 @@ void Http::Response::clear(void)
 	cookies.clear();
 }
 
+Http::Connection::Connection(Stream *stream) :
+	mStream(stream),
+	mKeepAlive(false),
+	mHead(false),
+	mChunked(false),
+	mClosed(false)
+{
+	Assert(stream);
+}
+
+Http::Connection::~Connection(void)
+{
+
+}
+
+void Http::Connection::begin(const Request &request, bool keepAlive)
+{
+	mChunked = false;
+	mBuffer.clear();
+
+	String connection;
+	request.headers.get("Connection", connection);
+
+	// Multipart bodies are not guaranteed to be read up to their end
+	String contentType;
+	request.headers.get("Content-Type", contentType);
+	bool multipart = (request.method == "POST" && contentType.contains("multipart"));
+
+	mKeepAlive = keepAlive
+		&& !mClosed
+		&& !multipart
+		&& request.version == "1.1"
+		&& connection.toLower() != "close";
+
+	mHead = (request.method == "HEAD");
+
+	// Coalesce headers and small writes until the response is flushed
+	mStream->cork();
+}
+
+bool Http::Connection::prepare(Response &response)
+{
+	if(response.code < 200) return false;	// Interim response
+
+	String connection;
+	if(response.headers.get("Connection", connection) && connection.toLower() == "close")
+		mKeepAlive = false;
+
+	if(!mKeepAlive)
+	{
+		if(response.version == "1.1") response.headers["Connection"] = "close";
+		return false;
+	}
+
+	if(mHead || response.code == 204 || response.code == 304 || response.headers.contains("Content-Length"))
+		return false;
+
+	response.headers["Transfer-Encoding"] = "chunked";
+	return true;
+}
+
+void Http::Connection::end(void)
+{
+	if(mClosed) return;
+
+	if(mChunked)
+	{
+		flush();
+		mChunked = false;
+		mStream->writeData("0\r\n\r\n", 5);
+	}
+
+	mStream->uncork();
+	mStream->flush();
+}
+
+bool Http::Connection::isKeepAlive(void) const
+{
+	return mKeepAlive && !mClosed;
+}
+
+void Http::Connection::setChunked(bool enabled)
+{
+	mChunked = enabled;
+}
+
+size_t Http::Connection::readData(char *buffer, size_t size)
+{
+	return mStream->readData(buffer, size);
+}
+
+void Http::Connection::writeData(const char *data, size_t size)
+{
+	if(!mChunked)
+	{
+		mStream->writeData(data, size);
+		return;
+	}
+
+	if(mBuffer.size() + size < BufferSize)
+	{
+		mBuffer.append(data, size);
+		return;
+	}
+
+	flush();
+	if(size < BufferSize) mBuffer.append(data, size);
+	else writeChunk(data, size);
+}
+
+bool Http::Connection::waitData(duration timeout)
+{
+	return mStream->waitData(timeout);
+}
+
+int64_t Http::Connection::writeFile(File &file, int64_t max)
+{
+	if(mChunked) return Stream::writeFile(file, max);
+	return mStream->writeFile(file, max);
+}
+
+void Http::Connection::flush(void)
+{
+	if(mChunked && !mBuffer.empty())
+	{
+		writeChunk(mBuffer.data(), mBuffer.size());
+		mBuffer.clear();
+	}
+
+	mStream->flush();
+}
+
+void Http::Connection::close(void)
+{
+	if(mClosed) return;
+
+	end();
+	mStream->close();
+	mKeepAlive = false;
+	mClosed = true;
+}
+
+void Http::Connection::writeChunk(const char *data, size_t size)
+{
+	if(!size) return;
+
+	String header = String::hexa(unsigned(size)) + "\r\n";
+	if(size < BufferSize)
+	{
+		BinaryString chunk;
+		chunk.reserve(header.size() + size + 2);
+		chunk.append(header);
+		chunk.append(data, size);
+		chunk.append("\r\n");
+		mStream->writeData(chunk.data(), chunk.size());
+	}
+	else {
+		mStream->writeData(header.data(), header.size());
+		mStream->writeData(data, size);
+		mStream->writeData("\r\n", 2);
+	}
+}
+
+Http::Waiter::Waiter(void)
+{
+
+}
+
+Http::Waiter::~Waiter(void)
+{
+	notify();
+}
+
+void Http::Waiter::notify(void)
+{
+	decltype(mParked) parked;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		std::swap(parked, mParked);
+	}
+
+	for(auto &p : parked)
+		if(!p.first.expired())	// expired if the request was resumed or timed out meanwhile
+			p.second();
+}
+
+void Http::Waiter::add(std::weak_ptr<void> session, std::function<void(void)> resume)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	// Drop entries of closed connections
+	auto it = mParked.begin();
+	while(it != mParked.end())
+	{
+		if(it->first.expired()) it = mParked.erase(it);
+		else ++it;
+	}
+
+	mParked.emplace_back(session, resume);
+}
+
+Http::Server::Session::Session(Stream *stream, const Address &remote) :
+	stream(stream),
+	connection(stream),
+	remote(remote),
+	count(0),
+	parked(false),
+	notified(false)
+{
+
+}
+
+Http::Server::Session::~Session(void)
+{
+	alarm.cancel();
+	delete stream;
+}
+
 Http::Server::Server(int port, int threads) :
 	mSock(port),
 	mPool(threads)
@@ -644,6 +901,9 @@ Http::Server::~Server(void)
 {
 	mSock.close();
 	mPool.join();
+
+	std::unique_lock<std::mutex> lock(mParkedMutex);
+	mParked.clear();
 }
 
 void Http::Server::generate(Stream &out, int code, const String &message)
@@ -657,42 +917,14 @@ void Http::Server::generate(Stream &out, int code, const String &message)
 
 void Http::Server::handle(Stream *stream, const Address &remote)
 {
-	Request request;
-	try {
-		try {
-			request.recv(stream);
-			request.remoteAddress = remote;
-			process(request);
-		}
-		catch(const Timeout &e)
-		{
-			throw 408;
-		}
-		catch(const NetException &e)
-		{
-			LogDebug("Http::Server::Handler", e.what());
-		}
- 		catch(const std::exception &e)
-		{
-			LogWarn("Http::Server::Handler", e.what());
-			throw 500;
-		}
-	}
-	catch(int code)
+	auto session = std::make_shared<Session>(stream, remote);
+	std::weak_ptr<Session> weak(session);
+	session->request.resume = [this, weak]()
 	{
-		try {
-			Response response(request, code);
-			response.headers["Content-Type"] = "text/html; charset=UTF-8";
-			response.send();
+		resume(weak, false);
+	};
 
-			if(request.method != "HEAD")
-				generate(*response.stream, response.code, response.message);
-		}
-		catch(...)
-		{
-
-		}
-	}
+	serve(session, false);
 }
 
 void Http::Server::respondWithFile(const Request &request, const String &fileName)
@@ -780,15 +1012,143 @@ void Http::Server::respondWithFile(const Request &request, const String &fileNam
 		if(hasRange)
 		{
 			file.seekRead(rangeBegin);
-			file.read(*response.stream, rangeEnd - rangeBegin + 1);
+			response.stream->writeFile(file, rangeEnd - rangeBegin + 1);
 		}
 		else {
-			file.read(*response.stream);
+			response.stream->writeFile(file, file.size());
 		}
 		file.close();
 	}
 }
 
+void Http::Server::serve(sptr<Session> session, bool resumed)
+{
+	Connection &connection = session->connection;
+	Request &request = session->request;
+
+	do {
+		try {
+			try {
+				if(!resumed)
+				{
+					request.recv(&connection);
+					request.remoteAddress = session->remote;
+					session->url = request.url;
+					connection.begin(request, ++session->count < MaxKeepAliveRequests);
+				}
+
+				while(true)
+				{
+					{
+						std::unique_lock<std::mutex> lock(session->mutex);
+						session->notified = false;
+						session->ticket = std::make_shared<bool>(true);
+						request.session = session->ticket;
+					}
+
+					request.url = session->url;	// prefix may have been stripped by the previous pass
+					request.parked = false;
+					request.resumed = resumed;
+					process(request);
+					if(!request.parked) break;
+
+					connection.flush();
+
+					std::unique_lock<std::mutex> lock(session->mutex);
+					if(!session->notified)
+					{
+						// Park the request, it is resumed by the waiter or on timeout
+						session->parked = true;
+						{
+							std::unique_lock<std::mutex> lock(mParkedMutex);
+							mParked.insert(session);
+						}
+
+						std::weak_ptr<Session> weak(session);
+						session->alarm.schedule(request.deadline, [this, weak]()
+						{
+							resume(weak, true);
+						});
+
+						return;
+					}
+
+					resumed = true;	// notified while processing, process again
+				}
+
+				resumed = false;
+				connection.end();
+			}
+			catch(const Timeout &e)
+			{
+				throw 408;
+			}
+			catch(const NetException &e)
+			{
+				LogDebug("Http::Server::Handler", e.what());
+				break;
+			}
+			catch(const std::exception &e)
+			{
+				LogWarn("Http::Server::Handler", e.what());
+				throw 500;
+			}
+		}
+		catch(int code)
+		{
+			try {
+				connection.begin(request, false);
+
+				Response response(request, code);
+				response.stream = &connection;
+				response.headers["Content-Type"] = "text/html; charset=UTF-8";
+				response.send();
+
+				if(request.method != "HEAD")
+					generate(*response.stream, response.code, response.message);
+			}
+			catch(...)
+			{
+
+			}
+
+			break;
+		}
+	}
+	while(connection.isKeepAlive() && connection.waitData(KeepAliveTimeout));
+}
+
+void Http::Server::resume(std::weak_ptr<Session> weak, bool expired)
+{
+	sptr<Session> session = weak.lock();
+	if(!session) return;
+
+	{
+		std::unique_lock<std::mutex> lock(session->mutex);
+		if(!session->parked)
+		{
+			if(!expired) session->notified = true;
+			return;
+		}
+
+		session->parked = false;
+		session->ticket.reset();	// entries left in other waiters are dropped
+		if(expired) session->request.expired = true;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mParkedMutex);
+		mParked.erase(session);
+	}
+
+	if(!expired) session->alarm.cancel();
+
+	mPool.post([this, session]()
+	{
+		serve(session, true);
+	});
+}
+
 void Http::Server::run(void)
 {
 	Socket *sock = NULL;
@@ -799,10 +1159,9 @@ void Http::Server::run(void)
 			mSock.accept(*sock);
 			sock->setReadTimeout(RequestTimeout);
 
-			mPool.enqueue([this, sock]()
+			mPool.post([this, sock]()
 			{
 				this->handle(sock, sock->getRemoteAddress());
-				delete sock;
 			});
 
 			sock = NULL;
@@ -836,18 +1195,20 @@ void Http::SecureServer::handle(Stream *stream, const Address &remote)
 {
 	SecureTransportServer *transport = NULL;
 	try {
-		transport = new SecureTransportServer(stream);
+		transport = new SecureTransportServer(stream);	// stream will be deleted by transport
+		stream = NULL;
 		transport->addCredentials(mCredentials);
 		transport->handshake();
-
-		Server::handle(transport, remote);
 	}
 	catch(const std::exception &e)
 	{
 		LogDebug("Http::SecureServer::Handler", e.what());
+		delete transport;
+		delete stream;
+		return;
 	}
 
-	delete transport;
+	Server::handle(transport, remote);
 }
 
 int Http::Action(const String &method, const String &url, const String &data, const StringMap &headers, Stream *output, StringMap *responseHeaders, StringMap *cookies, int maxRedirections, bool noproxy)
@@ -24,12 +24,16 @@
 
 #include "pla/include.hpp"
 #include "pla/string.hpp"
+#include "pla/binarystring.hpp"
 #include "pla/stream.hpp"
 #include "pla/serversocket.hpp"
 #include "pla/threadpool.hpp"
 #include "pla/securetransport.hpp"
 #include "pla/file.hpp"
 #include "pla/map.hpp"
+#include "pla/set.hpp"
+#include "pla/list.hpp"
+#include "pla/alarm.hpp"
 
 namespace pla
 {
@@ -40,6 +44,10 @@ public:
 	static String UserAgent;
 	static duration ConnectTimeout;
 	static duration RequestTimeout;
+	static duration KeepAliveTimeout;
+	static unsigned MaxKeepAliveRequests;
+
+	class Waiter;
 
 	struct Request
 	{
@@ -52,6 +60,13 @@ public:
 		void clear(void);
 		bool extractRange(int64_t &rangeBegin, int64_t &rangeEnd, int64_t contentLength = -1) const;
 
+		// Long-polling: suspend the request without holding a server thread,
+		// process() is called again when waiter is notified or on timeout
+		bool park(Waiter &waiter, duration timeout);	// returns false if the request can't be parked
+		bool isParked(void) const;
+		bool isResumed(void) const;
+		bool isExpired(void) const;
+
 		String protocol;		// HTTP or HTTPS
 		String method;			// GET, POST, HEAD...
 		String version;			// 1.0 or 1.1
@@ -65,6 +80,12 @@ public:
 
 		String fullUrl;		// URL with parameters
 		Stream *stream;		// Internal use for Response construction
+
+		// Internal use for parking
+		std::function<void(void)> resume;
+		std::weak_ptr<void> session;
+		Alarm::time_point deadline;
+		bool parked, resumed, expired;
 	};
 
 	struct Response
@@ -86,6 +107,54 @@ public:
 		Stream *stream;		// Stream where to send/receive data
 	};
 
+	// Server-side connection handling persistent connections and chunked responses
+	class Connection : public Stream
+	{
+	public:
+		Connection(Stream *stream);
+		~Connection(void);
+
+		void begin(const Request &request, bool keepAlive = true);
+		bool prepare(Response &response);	// returns true if the response must be chunked
+		void end(void);
+
+		bool isKeepAlive(void) const;
+		void setChunked(bool enabled);
+
+		// Stream
+		size_t readData(char *buffer, size_t size);
+		void writeData(const char *data, size_t size);
+		bool waitData(duration timeout);
+		int64_t writeFile(File &file, int64_t max);
+		void flush(void);
+		void close(void);
+
+	private:
+		void writeChunk(const char *data, size_t size);
+
+		Stream *mStream;
+		BinaryString mBuffer;
+		bool mKeepAlive, mHead, mChunked, mClosed;
+	};
+
+	// Notifies requests parked with Request::park()
+	class Waiter
+	{
+	public:
+		Waiter(void);
+		~Waiter(void);
+
+		void notify(void);
+
+	private:
+		void add(std::weak_ptr<void> session, std::function<void(void)> resume);
+
+		List<std::pair<std::weak_ptr<void>, std::function<void(void)> > > mParked;
+		std::mutex mMutex;
+
+		friend struct Request;
+	};
+
 	class Server
 	{
 	public:
@@ -96,14 +165,36 @@ public:
 		virtual void generate(Stream &out, int code, const String &message);
 
 	protected:
-		virtual void handle(Stream *stream, const Address &remote);
+		virtual void handle(Stream *stream, const Address &remote);	// stream will be deleted
 		virtual void respondWithFile(const Request &request, const String &fileName);
 
 		ServerSocket mSock;
 		ThreadPool mPool;
 
 	private:
+		struct Session
+		{
+			Session(Stream *stream, const Address &remote);
+			~Session(void);
+
+			Stream *stream;
+			Connection connection;
+			Request request;
+			String url;		// original request url, process() may modify it
+			sptr<void> ticket;	// held while a request may be parked, waiters keep a weak reference
+			Address remote;
+			Alarm alarm;
+			unsigned count;
+			bool parked, notified;
+			std::mutex mutex;
+		};
+
 		void run(void);
+		void serve(sptr<Session> session, bool resumed);
+		void resume(std::weak_ptr<Session> weak, bool expired);
+
+		Set<sptr<Session> > mParked;
+		std::mutex mParkedMutex;
 	};
 
 	class SecureServer : public Server
@@ -35,16 +35,15 @@ JsonSerializer::JsonSerializer(Stream *stream) :
 
 JsonSerializer::~JsonSerializer(void)
 {
-
+	NOEXCEPTION(flush());
 }
 
 bool JsonSerializer::read(Serializable &s)
 {
 	if(s.isInlineSerializable() && !s.isNativeSerializable())
 	{
-		String str;
-		if(!Serializer::read(str)) return false;
-		s.fromString(str);
+		if(!readScalar()) return false;
+		s.fromString(mToken);
 		return true;
 	}
 	else return s.deserialize(*this);
@@ -52,232 +51,436 @@ bool JsonSerializer::read(Serializable &s)
 
 bool JsonSerializer::read(std::string &str)
 {
-	const String fieldDelimiters = ",:]}";
-
 	str.clear();
 
 	char chr;
-	if(!mStream->get(chr)) return false;
-	while(Stream::BlankCharacters.contains(chr))
-		if(!mStream->get(chr)) return false;
+	if(!peekBlank(chr)) return false;
+	if(chr == ',' || chr == ':' || chr == ']' || chr == '}') return false;
 
-	if(fieldDelimiters.contains(chr))
+	// Special case: read map or array in string
+	if(chr == '{' || chr == '[') readRaw(str);
+	else if(chr == '\"' || chr == '\'')
 	{
-		if(chr == '}' || chr == ']')
-		{
-			do {
-				if(!mStream->get(chr))
-					return false;
-			}
-			while(Stream::BlankCharacters.contains(chr));
-		}
-		return false;
+		++mReadOffset;
+		readQuoted(str, chr);
 	}
+	else readUnquoted(str);
 
-	// Special case: read map or array in string
-	if(chr == '{' || chr == '[')
-	{
-		char opening = chr;
-		char closing;
-		if(opening ==  '{') closing = '}';
-		else closing = ']';
+	// Consume key separator
+	if(mReadLevel > 0 && peekBlank(chr) && chr == ':')
+		++mReadOffset;
 
-		int count = 1;
-		str+= chr;
-		while(count)
-		{
-			AssertIO(mStream->get(chr));
-			str+= chr;
+	return true;
+}
 
-			if(chr == opening) ++count;
-			else if(chr == closing) --count;
-		}
+bool JsonSerializer::read(bool &b)
+{
+	if(!readScalar()) return false;
+	if(mToken == "true" || mToken == "1") b = true;
+	else if(mToken == "false" || mToken == "0" || mToken.empty()) b = false;
+	else throw InvalidData("Invalid boolean value: \"" + mToken + "\"");
+	return true;
+}
 
-		do {
-			if(!mStream->get(chr))
-				return true;
-		}
-		while(Stream::BlankCharacters.contains(chr));
+bool JsonSerializer::readScalar(void)
+{
+	return JsonSerializer::read(mToken);
+}
 
-		AssertIO(fieldDelimiters.contains(chr));
-		return true;
-	}
+bool JsonSerializer::readInteger(int64_t &i)
+{
+	if(!readScalar()) return false;
+	const char *str = mToken.c_str();
+	char *end = NULL;
+	i = int64_t(std::strtoll(str, &end, 10));
+	AssertIO(end != str);
+	return true;
+}
 
-	bool quotes = (chr == '\'' || chr == '\"');
+bool JsonSerializer::readUnsigned(uint64_t &i)
+{
+	if(!readScalar()) return false;
+	const char *str = mToken.c_str();
+	char *end = NULL;
+	i = uint64_t(std::strtoull(str, &end, 10));
+	AssertIO(end != str);
+	return true;
+}
 
-	String delimiters;
-	if(quotes)
-	{
-		delimiters = String(chr);
-		AssertIO(mStream->get(chr));
-	}
-	else {
-		str+= chr;
-		delimiters = Stream::BlankCharacters;
-		delimiters+=fieldDelimiters;
-		if(!mStream->get(chr)) return true;
-	}
+bool JsonSerializer::readFloat(double &f)
+{
+	if(!readScalar()) return false;
+	const char *str = mToken.c_str();
+	char *end = NULL;
+	f = std::strtod(str, &end);
+	AssertIO(end != str);
+	return true;
+}
 
-	while(!delimiters.contains(chr))
+void JsonSerializer::readQuoted(std::string &str, char quote)
+{
+	unsigned surrogate = 0;
+	while(true)
 	{
-		if(chr == '\\')
+		AssertIO(fill());
+
+		// Append unescaped characters in one go
+		const char *begin = mReadBuffer + mReadOffset;
+		const char *end = mReadBuffer + mReadSize;
+		const char *p = begin;
+		while(p != end && *p != quote && *p != '\\') ++p;
+		str.append(begin, p - begin);
+		mReadOffset+= p - begin;
+		if(p == end) continue;
+
+		++mReadOffset;
+		if(*p == quote) break;
+
+		char chr;
+		AssertIO(get(chr));
+		switch(chr)
 		{
-			AssertIO(mStream->get(chr));
-			switch(chr)
-			{
-			case 'b': 	chr = '\b';	break;
-			case 'f': 	chr = '\f';	break;
-			case 'n': 	chr = '\n';	break;
-			case 'r': 	chr = '\r';	break;
-			case 't': 	chr = '\t';	break;
-			case 'u':
+		case 'b': 	str+= '\b';	break;
+		case 'f': 	str+= '\f';	break;
+		case 'n': 	str+= '\n';	break;
+		case 'r': 	str+= '\r';	break;
+		case 't': 	str+= '\t';	break;
+		case 'u':
+		{
+			unsigned u = 0;
+			for(int k=0; k<4; ++k)
 			{
-				String tmp;
-				AssertIO(mStream->read(tmp, 4));
-
-				unsigned u = 0;
-				tmp.hexaMode(true);
-				tmp >> u;
+				AssertIO(get(chr));
+				u<<= 4;
+				if(chr >= '0' && chr <= '9') u|= unsigned(chr - '0');
+				else if(chr >= 'a' && chr <= 'f') u|= unsigned(chr - 'a' + 10);
+				else if(chr >= 'A' && chr <= 'F') u|= unsigned(chr - 'A' + 10);
+				else throw IOException();
+			}
 
-				wchar_t wstr[2];
-				wstr[0] = wchar_t(u);
-				wstr[1] = 0;
+			// Encode as UTF-8, combining surrogate pairs
+			if(u >= 0xD800 && u <= 0xDBFF)
+			{
+				surrogate = ((u - 0xD800) << 10) + 0x10000;
+				continue;
+			}
+			if(u >= 0xDC00 && u <= 0xDFFF) u = surrogate | (u - 0xDC00);
+			surrogate = 0;
 
-				str+= String(wstr);
-				chr = 0;
-				break;
+			if(u <= 0x7F) str+= char(u);
+			else if(u <= 0x7FF)
+			{
+				str+= char(0xC0 | ((u >> 6) & 0x1F));
+				str+= char(0x80 | (u & 0x3F));
 			}
-			default:
-				if(isalpha(chr) || isdigit(chr))
-					chr = 0; // unknown escape sequence
-				break;
+			else if(u <= 0xFFFF)
+			{
+				str+= char(0xE0 | ((u >> 12) & 0x0F));
+				str+= char(0x80 | ((u >> 6) & 0x3F));
+				str+= char(0x80 | (u & 0x3F));
+			}
+			else {
+				str+= char(0xF0 | ((u >> 18) & 0x07));
+				str+= char(0x80 | ((u >> 12) & 0x3F));
+				str+= char(0x80 | ((u >> 6) & 0x3F));
+				str+= char(0x80 | (u & 0x3F));
 			}
+			break;
+		}
+		default:
+			if(!isalpha(chr) && !isdigit(chr))	// ignore unknown escape sequence
+				str+= chr;
+			break;
+		}
+	}
+}
+
+void JsonSerializer::readUnquoted(std::string &str)
+{
+	while(fill())
+	{
+		const char *begin = mReadBuffer + mReadOffset;
+		const char *end = mReadBuffer + mReadSize;
+		const char *p = begin;
+		while(p != end)
+		{
+			char chr = *p;
+			if(chr == ' ' || chr == '\t' || chr == '\r' || chr == '\n'
+				|| chr == ',' || chr == ':' || chr == ']' || chr == '}')
+				break;
+			++p;
 		}
 
-		if(chr) str+= chr;
-		if(!mStream->get(chr))
+		str.append(begin, p - begin);
+		mReadOffset+= p - begin;
+		if(p != end) break;
+	}
+}
+
+void JsonSerializer::readRaw(std::string &str)
+{
+	int count = 0;
+	char quote = 0;
+	bool escape = false;
+	do {
+		char chr;
+		AssertIO(get(chr));
+		str+= chr;
+
+		if(quote)
 		{
-			if(quotes) throw IOException();
-			else break;
+			if(escape) escape = false;
+			else if(chr == '\\') escape = true;
+			else if(chr == quote) quote = 0;
 		}
+		else if(chr == '\"' || chr == '\'') quote = chr;
+		else if(chr == '{' || chr == '[') ++count;
+		else if(chr == '}' || chr == ']') --count;
 	}
+	while(count);
+}
+
+bool JsonSerializer::readBegin(char opening)
+{
+	char chr;
+	if(!peekBlank(chr)) return false;
+	if(chr == '}' || chr == ']') return false;
+	AssertIO(chr == opening);
+
+	++mReadOffset;
+	++mReadLevel;
+	mFirst = true;
+	return true;
+}
+
+bool JsonSerializer::readNext(void)
+{
+	char chr;
+	if(!peekBlank(chr)) return false;
 
-	if(!fieldDelimiters.contains(chr))
+	if(!mFirst)
 	{
-		do {
-			if(!mStream->get(chr))
-				return true;
+		if(chr == ',')
+		{
+			++mReadOffset;
+			if(!peekBlank(chr)) return false;
 		}
-		while(Stream::BlankCharacters.contains(chr));
+		else AssertIO(chr == '}' || chr == ']');
+	}
 
-		AssertIO(fieldDelimiters.contains(chr));
+	mFirst = false;
+	if(chr == '}' || chr == ']')
+	{
+		readEnd();
+		return false;
 	}
 
 	return true;
 }
 
+void JsonSerializer::readEnd(void)
+{
+	++mReadOffset;
+	if(mReadLevel > 0) --mReadLevel;
+	mFirst = false;
+}
+
+bool JsonSerializer::fill(void)
+{
+	if(mReadOffset < mReadSize) return true;
+	mReadOffset = 0;
+	mReadSize = mStream->readData(mReadBuffer, BufferSize);
+	return mReadSize > 0;
+}
+
+bool JsonSerializer::get(char &chr)
+{
+	if(!fill()) return false;
+	chr = mReadBuffer[mReadOffset++];
+	return true;
+}
+
+bool JsonSerializer::peekBlank(char &chr)
+{
+	while(fill())
+	{
+		chr = mReadBuffer[mReadOffset];
+		if(chr != ' ' && chr != '\t' && chr != '\r' && chr != '\n') return true;
+		++mReadOffset;
+	}
+	return false;
+}
+
 void JsonSerializer::write(const Serializable &s)
 {
 	if(s.isInlineSerializable() && !s.isNativeSerializable()) Serializer::write(s.toString());
 	else s.serialize(*this);
-	if(mKey) *mStream << ':' << Stream::Space;
+	if(mKey) output(": ", 2);
 	mKey = false;
+	if(mLevel == 0) flush();
 }
 
 void JsonSerializer::write(const std::string &str)
 {
-	*mStream<<'\"';
-	for(size_t i=0; i<str.size(); ++i)
+	// Escape sequences for characters, 'u' means \u00XX
+	static const char escapes[256] = {
+		'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+		'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+		0,0,'\"',0,0,0,0,0,0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,0,0,0,0,0,'\\',0,0,0
+		// others are zero
+	};
+
+	static const char hexa[] = "0123456789ABCDEF";
+
+	output('\"');
+
+	const char *data = str.data();
+	size_t size = str.size();
+	size_t begin = 0;
+	for(size_t i=0; i<size; ++i)
 	{
-		char chr = str[i];
-		switch(chr)
+		char esc = escapes[uint8_t(data[i])];
+		if(!esc) continue;
+
+		output(data + begin, i - begin);
+		begin = i + 1;
+
+		if(esc == 'u')
 		{
-		case '\\': mStream->write("\\\\"); break;
-		case '\"': mStream->write("\\\""); break;
-		//case '\'': mStream->write("\\\'"); break;
-		case '\b': mStream->write("\\b");  break;
-		case '\f': mStream->write("\\f");  break;
-		case '\n': mStream->write("\\n");  break;
-		case '\r': mStream->write("\\r");  break;
-		case '\t': mStream->write("\\t");  break;
-		default: mStream->put(chr); break;
+			char seq[6] = { '\\', 'u', '0', '0', hexa[(uint8_t(data[i]) >> 4) & 0xF], hexa[uint8_t(data[i]) & 0xF] };
+			output(seq, 6);
+		}
+		else {
+			char seq[2] = { '\\', esc };
+			output(seq, 2);
 		}
 	}
-	*mStream<<'\"';
 
-	if(mKey) *mStream << ':' << Stream::Space;
+	output(data + begin, size - begin);
+	output('\"');
+
+	if(mKey) output(": ", 2);
 	mKey = false;
+	if(mLevel == 0) flush();
 }
 
-bool JsonSerializer::readArrayBegin(void)
+void JsonSerializer::write(bool b)
 {
-	char chr;
-	do if(!mStream->get(chr)) return false;
-	while(Stream::BlankCharacters.contains(chr));
+	if(b) writeValue("true", 4);
+	else writeValue("false", 5);
+}
 
-	if(chr == '[') return true;
-	if(chr == '}' || chr == ']') return false;
+void JsonSerializer::writeInteger(int64_t i)
+{
+	if(i >= 0)
+	{
+		writeUnsigned(uint64_t(i));
+		return;
+	}
 
-	throw IOException();
+	char buffer[24];
+	char *end = buffer + sizeof(buffer);
+	char *p = end;
+	uint64_t u = uint64_t(-(i+1)) + 1;	// no overflow on minimum value
+	do {
+		*--p = '0' + char(u % 10);
+		u/= 10;
+	}
+	while(u);
+	*--p = '-';
+
+	writeValue(p, end - p);
 }
 
-bool JsonSerializer::readArrayNext(void)
+void JsonSerializer::writeUnsigned(uint64_t i)
 {
-	char chr = mStream->last();
-	while(Stream::BlankCharacters.contains(chr))
-		if(!mStream->get(chr))
-			return false;
-
-	if(chr == '[' || chr == ',') return true;
-	if(chr == '}' || chr == ']')
-	{
-		mStream->ignore(1);
-		return false;
+	char buffer[24];
+	char *end = buffer + sizeof(buffer);
+	char *p = end;
+	do {
+		*--p = '0' + char(i % 10);
+		i/= 10;
 	}
+	while(i);
 
-	throw IOException();
+	writeValue(p, end - p);
 }
 
-bool JsonSerializer::readMapBegin(void)
+void JsonSerializer::writeFloat(double f)
 {
-	char chr;
-	do if(!mStream->get(chr)) return false;
-	while(Stream::BlankCharacters.contains(chr));
+	// Same output as the default ostream formatting
+	char buffer[32];
+	int len = std::snprintf(buffer, sizeof(buffer), "%g", f);
+	Assert(len > 0 && len < int(sizeof(buffer)));
+	writeValue(buffer, size_t(len));
+}
 
-	if(chr == '{') return true;
-	if(chr == '}' || chr == ']') return false;
+void JsonSerializer::writeValue(const char *data, size_t size)
+{
+	output(data, size);
+	if(mKey) output(": ", 2);
+	else if(mLevel == 0) output("\r\n", 2);
+	mKey = false;
+	if(mLevel == 0) flush();
+}
 
-	throw IOException();
+void JsonSerializer::writeIndent(void)
+{
+	output("\r\n", 2);
+	mBuffer.append(mLevel*2, ' ');
 }
 
-bool JsonSerializer::readMapNext(void)
+void JsonSerializer::output(const char *data, size_t size)
 {
-	char chr = mStream->last();
-	while(Stream::BlankCharacters.contains(chr))
-		if(!mStream->get(chr))
-			return false;
+	mBuffer.append(data, size);
+	if(mBuffer.size() >= BufferSize*4) flush();
+}
 
-	if(chr == '{' || chr == ',') return true;
-	if(chr == '}' || chr == ']')
-	{
-		mStream->ignore(1);
-		return false;
-	}
+void JsonSerializer::output(char chr)
+{
+	mBuffer+= chr;
+}
+
+void JsonSerializer::flush(void)
+{
+	if(mBuffer.empty()) return;
+	mStream->writeData(mBuffer.data(), mBuffer.size());
+	mBuffer.clear();
+}
+
+bool JsonSerializer::readArrayBegin(void)
+{
+	return readBegin('[');
+}
+
+bool JsonSerializer::readArrayNext(void)
+{
+	return readNext();
+}
 
-	throw IOException();
+bool JsonSerializer::readMapBegin(void)
+{
+	return readBegin('{');
+}
+
+bool JsonSerializer::readMapNext(void)
+{
+	return readNext();
 }
 
 void JsonSerializer::writeArrayBegin(size_t size)
 {
-	*mStream<<'[';
+	output('[');
 	++mLevel;
 }
 
 void JsonSerializer::writeArrayNext(size_t i)
 {
-	if(i > 0) *mStream<<',';
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ');
+	if(i > 0) output(',');
+	writeIndent();
 	mKey = false;
 }
 
@@ -285,21 +488,21 @@ void JsonSerializer::writeArrayEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ')<<']';
+	writeIndent();
+	output(']');
+	if(mLevel == 0) flush();
 }
 
 void JsonSerializer::writeMapBegin(size_t size)
 {
-	*mStream<<'{';
+	output('{');
 	++mLevel;
 }
 
 void JsonSerializer::writeMapNext(size_t i)
 {
-	if(i > 0) *mStream<<',';
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ');
+	if(i > 0) output(',');
+	writeIndent();
 	mKey = true;
 }
 
@@ -307,8 +510,9 @@ void JsonSerializer::writeMapEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ')<<'}';
+	writeIndent();
+	output('}');
+	if(mLevel == 0) flush();
 }
 
 }
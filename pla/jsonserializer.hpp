@@ -46,23 +46,23 @@ private:
 	bool read(uint16_t &i)	{ return readValue(i); }
 	bool read(uint32_t &i)	{ return readValue(i); }
 	bool read(uint64_t &i)	{ return readValue(i); }
-	bool read(bool &b)	{ return readValue(b); }
+	bool read(bool &b);
 	bool read(float &f)	{ return readValue(f); }
 	bool read(double &f)	{ return readValue(f); }
 
 	void write(const Serializable &s);
 	void write(const std::string &str);
-	void write(int8_t i)	{ writeValue(i); }
-	void write(int16_t i)	{ writeValue(i); }
-	void write(int32_t i)	{ writeValue(i); }
-	void write(int64_t i)	{ writeValue(i); }
-	void write(uint8_t i)	{ writeValue(i); }
-	void write(uint16_t i)	{ writeValue(i); }
-	void write(uint32_t i)	{ writeValue(i); }
-	void write(uint64_t i)	{ writeValue(i); }
-	void write(bool b)	{ writeValue(b); }
-	void write(float f)	{ writeValue(f); }
-	void write(double f)	{ writeValue(f); }
+	void write(int8_t i)	{ writeInteger(i); }
+	void write(int16_t i)	{ writeInteger(i); }
+	void write(int32_t i)	{ writeInteger(i); }
+	void write(int64_t i)	{ writeInteger(i); }
+	void write(uint8_t i)	{ writeUnsigned(i); }
+	void write(uint16_t i)	{ writeUnsigned(i); }
+	void write(uint32_t i)	{ writeUnsigned(i); }
+	void write(uint64_t i)	{ writeUnsigned(i); }
+	void write(bool b);
+	void write(float f)	{ writeFloat(f); }
+	void write(double f)	{ writeFloat(f); }
 
 	bool readArrayBegin(void);
 	bool readArrayNext(void);
@@ -77,32 +77,71 @@ private:
 	void writeMapEnd(void);
 
 	template<typename T> bool readValue(T &value);
-	template<typename T> void writeValue(const T &value);
+
+	// Scalars are tokenized in place from the input buffer, numbers are converted without temporaries
+	bool readScalar(void);
+	bool readInteger(int64_t &i);
+	bool readUnsigned(uint64_t &i);
+	bool readFloat(double &f);
+	void readQuoted(std::string &str, char quote);
+	void readUnquoted(std::string &str);
+	void readRaw(std::string &str);
+	bool readBegin(char opening);
+	bool readNext(void);
+	void readEnd(void);
+
+	// Input is read ahead in blocks, the stream must be consumed by the serializer only
+	bool fill(void);
+	bool get(char &chr);
+	bool peekBlank(char &chr);
+
+	void writeInteger(int64_t i);
+	void writeUnsigned(uint64_t i);
+	void writeFloat(double f);
+	void writeValue(const char *data, size_t size);
+	void writeIndent(void);
+
+	// Output is buffered and flushed in large chunks or when a top-level value is complete
+	void output(const char *data, size_t size);
+	void output(char chr);
+	void flush(void);
 
 	Stream *mStream;
+	std::string mBuffer;
 	int mLevel = 0;
 	bool mKey = false;
+
+	char mReadBuffer[BufferSize];
+	size_t mReadOffset = 0;
+	size_t mReadSize = 0;
+	std::string mToken;
+	int mReadLevel = 0;
+	bool mFirst = false;
 };
 
 template<typename T>
 bool JsonSerializer::readValue(T &value)
 {
-	String tmp;
-	if(!Serializer::read(tmp)) return false;
-	AssertIO(tmp.read(value));
+	if(std::is_floating_point<T>::value)
+	{
+		double f;
+		if(!readFloat(f)) return false;
+		value = T(f);
+	}
+	else if(std::is_signed<T>::value)
+	{
+		int64_t i;
+		if(!readInteger(i)) return false;
+		value = T(i);
+	}
+	else {
+		uint64_t i;
+		if(!readUnsigned(i)) return false;
+		value = T(i);
+	}
 	return true;
 }
 
-template<typename T>
-void JsonSerializer::writeValue(const T &value)
-{
-	mStream->space();
-	mStream->write(value);
-	if(mKey) *mStream << ':' << Stream::Space;
-	else if(mLevel == 0) *mStream << Stream::NewLine;
-	mKey = false;
-}
-
 }
 
 #endif
@@ -23,23 +23,30 @@
 #define PLA_SCHEDULER_H
 
 #include "pla/threadpool.hpp"
+#include "pla/exception.hpp"
 
 #include <chrono>
-#include <map>
-#include <set>
+#include <vector>
+#include <unordered_map>
+#include <limits>
+#include <cmath>
 
 namespace pla
 {
 
+// Timers are kept in a hierarchical timing wheel, so arming, re-arming and cancelling
+// are O(1). Cancelled or postponed timers leave stale wheel entries which are skipped
+// or moved lazily when their slot is reached.
 class Scheduler : protected ThreadPool
 {
 public:
 	using clock = std::chrono::steady_clock;
 	typedef std::chrono::duration<double> duration;
 	typedef std::chrono::time_point<clock, duration> time_point;
-	struct task_id : public std::pair<time_point, unsigned>
+	struct task_id
 	{
-		task_id(void) : std::pair<time_point, unsigned>(clock::time_point::min(), 0) {}
+		task_id(void) : serial(0) {}
+		uint64_t serial;
 	};
 
 	Scheduler(size_t threads = 1);
@@ -61,6 +68,9 @@ public:
 	auto schedule(duration d, F&& f, Args&&... args)
 		-> std::future<typename std::result_of<F(Args...)>::type>;
 
+	// Arm or re-arm a timer without creating a future
+	void arm(task_id &id, time_point time, const std::function<void()> &f);
+
 	void wait(task_id id);
 	void cancel(task_id id);
 
@@ -70,38 +80,99 @@ public:
 	void join(void);
 
 private:
-	std::map<task_id, std::function<void()> > scheduling;
-	std::set<task_id> pending;
+	static const unsigned Levels = 4;
+	static const unsigned SlotBits = 8;
+	static const unsigned Slots = 1 << SlotBits;
+
+	struct Timer
+	{
+		std::function<void()> function;
+		uint64_t tick;		// expiration tick
+		uint64_t entryTick;	// tick of the wheel entry in charge of the timer
+	};
+
+	struct Entry
+	{
+		uint64_t serial;
+		uint64_t tick;
+	};
+
+	// Runs an expired timer on the pool
+	struct Dispatch
+	{
+		Scheduler *scheduler;
+		uint64_t serial;
+		std::function<void()> function;
+
+		void operator()(void);
+	};
+
+	typedef std::vector<std::pair<uint64_t, std::function<void()> > > DueList;
+
+	uint64_t tickOf(time_point time) const;	// rounded up, timers never expire early
+	uint64_t currentTick(void) const;
+	void insert(const Entry &entry);
+	void cascade(unsigned level, size_t index);
+	void expire(std::vector<Entry> &entries, DueList &due);
+	void advance(uint64_t target, DueList &due);
+	uint64_t nextTick(void) const;
+
+	std::unordered_map<uint64_t, Timer> timers;
+	std::unordered_map<uint64_t, std::thread::id> running;
+	std::vector<Entry> wheel[Levels][Slots];
+	std::vector<Entry> expired;
+	std::vector<Entry> scratch;
+	size_t counts[Levels];
+	uint64_t current;	// last processed tick
+	uint64_t wakeTick;	// tick the thread sleeps until
+	uint64_t nextSerial;
+	const time_point origin;
+	const duration resolution;
+
 	std::condition_variable schedulingCondition, pendingCondition;
 	std::thread thread;
 };
 
 inline Scheduler::Scheduler(size_t threads) :
-	ThreadPool(threads)
+	ThreadPool(threads),
+	current(0),
+	wakeTick(0),
+	nextSerial(0),
+	origin(clock::now()),
+	resolution(0.001)	// 1 ms
 {
+	for(unsigned l=0; l<Levels; ++l)
+		counts[l] = 0;
+
 	thread = std::thread([this]()
 	{
+		DueList due;
 		std::unique_lock<std::mutex> lock(mutex);
-		while(true)
+		while(!joining)
 		{
-			if(scheduling.empty())
+			wakeTick = 0;
+			advance(currentTick(), due);
+
+			if(!due.empty())
 			{
-				schedulingCondition.wait(lock);
-			}
-			else {
-				task_id id = scheduling.begin()->first;
-				time_point time = id.first;
-				if(time > clock::now())
+				// Expirations of the tick are handed to the pool as a batch
+				lock.unlock();
+				for(auto &d : due)
 				{
-					schedulingCondition.wait_until(lock, time);
-				}
-				else {
-					auto task = scheduling.begin()->second;
-					scheduling.erase(scheduling.begin());
-					tasks.emplace(std::move(task));
-					condition.notify_one();
+					Dispatch dispatch;
+					dispatch.scheduler = this;
+					dispatch.serial = d.first;
+					dispatch.function = std::move(d.second);
+					submit(Task(std::move(dispatch)), false);
 				}
+				due.clear();
+				lock.lock();
+				continue;
 			}
+
+			wakeTick = nextTick();
+			if(wakeTick == std::numeric_limits<uint64_t>::max()) schedulingCondition.wait(lock);
+			else schedulingCondition.wait_until(lock, origin + duration(resolution.count()*double(wakeTick)));
 		}
 	});
 }
@@ -122,40 +193,11 @@ auto Scheduler::schedule(task_id &id, time_point time, F&& f, Args&&... args)
 	auto task = std::make_shared<std::packaged_task<type()> >(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 	std::future<type> result = task->get_future();
 
+	arm(id, time, [task]()
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		if(joining) throw std::runtime_error("schedule on closing Scheduler");
-
-		// Remove previous task
-		if(id.second)
-		{
-			auto it = scheduling.find(id);
-			if(it != scheduling.end())
-			{
-				scheduling.erase(it);
-				pending.erase(id);
-				pendingCondition.notify_all();
-			}
-		}
-
-		// Find new task id
-		id.first = time;
-		id.second = 1;
-		while(scheduling.find(id) != scheduling.end())
-			id.second++;
-
-		// Add new task
-		pending.insert(id);
-		scheduling.emplace(std::make_pair(id, [task, id, this]()
-		{
-			(*task)();
-			std::unique_lock<std::mutex> lock(mutex);
-			pending.erase(id);
-			pendingCondition.notify_all();
-		}));
-	}
+		(*task)();
+	});
 
-	schedulingCondition.notify_all();
 	return result;
 }
 
@@ -182,48 +224,76 @@ auto Scheduler::schedule(duration d, F&& f, Args&&... args)
 	return schedule(id, clock::now() + d, std::forward<F>(f), std::forward<Args>(args)...);
 }
 
-inline void Scheduler::wait(Scheduler::task_id id)
+inline void Scheduler::arm(task_id &id, time_point time, const std::function<void()> &f)
 {
-	if(id.second)
+	bool wake = false;
 	{
 		std::unique_lock<std::mutex> lock(mutex);
+		if(joining) throw std::runtime_error("schedule on closing Scheduler");
 
-		// Protect form deadlocks, especially on Alarm destruction
-		std::thread::id tid = std::this_thread::get_id();
-		for(const std::thread &t : workers)
-			if(t.get_id() == tid)
-				break;
+		uint64_t tick = tickOf(time);
+
+		auto it = (id.serial ? timers.find(id.serial) : timers.end());
+		if(it != timers.end())
+		{
+			// Re-arm, a later expiration is handled when the current entry is reached
+			Timer &timer = it->second;
+			timer.function = f;
+			timer.tick = tick;
+			if(tick < timer.entryTick)
+			{
+				timer.entryTick = tick;
+				insert(Entry{id.serial, tick});
+			}
+		}
+		else {
+			id.serial = ++nextSerial;
+			Timer &timer = timers[id.serial];
+			timer.function = f;
+			timer.tick = tick;
+			timer.entryTick = tick;
+			insert(Entry{id.serial, tick});
+		}
+
+		wake = (tick < wakeTick);
+	}
+
+	if(wake) schedulingCondition.notify_all();
+}
+
+inline void Scheduler::wait(Scheduler::task_id id)
+{
+	if(id.serial)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
 
 		pendingCondition.wait(lock, [this, id]() {
-			return pending.find(id) == pending.end();
+			if(timers.find(id.serial) != timers.end())
+				return false;
+
+			// Protect from deadlocks, especially on Alarm destruction from the task itself
+			auto it = running.find(id.serial);
+			return it == running.end() || it->second == std::this_thread::get_id();
 		});
 	}
 }
 
 inline void Scheduler::cancel(Scheduler::task_id id)
 {
-	if(id.second)
+	if(id.serial)
 	{
 		std::unique_lock<std::mutex> lock(mutex);
-		auto it = scheduling.find(id);
-		if(it != scheduling.end())
-		{
-			scheduling.erase(it);
-			schedulingCondition.notify_all();
-			pending.erase(id);
-			pendingCondition.notify_all();
-		}
+		if(timers.erase(id.serial))
+			pendingCondition.notify_all();	// wheel entries are dropped lazily
 	}
 }
 
 inline bool Scheduler::isScheduled(Scheduler::task_id id)
 {
-	if(id.second)
+	if(id.serial)
 	{
 		std::unique_lock<std::mutex> lock(mutex);
-		auto it = scheduling.find(id);
-		if(it != scheduling.end())
-			return true;
+		return timers.find(id.serial) != timers.end();
 	}
 
 	return false;
@@ -233,24 +303,226 @@ inline void Scheduler::clear(void)
 {
 	{
 		std::unique_lock<std::mutex> lock(mutex);
-		for(auto p : scheduling)
-			pending.erase(p.first);
-		scheduling.clear();
+		timers.clear();
+		expired.clear();
+		for(unsigned l=0; l<Levels; ++l)
+		{
+			for(unsigned i=0; i<Slots; ++i)
+				wheel[l][i].clear();
+			counts[l] = 0;
+		}
+	}
+
+	// Drop queued dispatches, then forget expired timers which will never start
+	ThreadPool::clear();
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = running.begin();
+		while(it != running.end())
+		{
+			if(it->second == std::thread::id()) it = running.erase(it);
+			else ++it;
+		}
 	}
 
 	schedulingCondition.notify_all();
 	pendingCondition.notify_all();
-	ThreadPool::clear();
 }
 
 inline void Scheduler::join(void)
 {
 	joining = true;
 
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+	}
+
+	schedulingCondition.notify_all();
 	if(thread.joinable()) thread.join();
 	ThreadPool::join();
 }
 
+inline void Scheduler::Dispatch::operator()(void)
+{
+	{
+		std::unique_lock<std::mutex> lock(scheduler->mutex);
+		scheduler->running[serial] = std::this_thread::get_id();
+	}
+
+	auto finish = [this]()
+	{
+		{
+			std::unique_lock<std::mutex> lock(scheduler->mutex);
+			scheduler->running.erase(serial);
+		}
+
+		scheduler->pendingCondition.notify_all();
+	};
+
+	try {
+		function();
+	}
+	catch(...)
+	{
+		finish();
+		throw;
+	}
+
+	finish();
+}
+
+inline uint64_t Scheduler::tickOf(time_point time) const
+{
+	double ticks = (time - origin).count()/resolution.count();
+	return ticks > 0. ? uint64_t(std::ceil(ticks)) : 0;
+}
+
+inline uint64_t Scheduler::currentTick(void) const
+{
+	double ticks = (time_point(clock::now()) - origin).count()/resolution.count();
+	return ticks > 0. ? uint64_t(ticks) : 0;
+}
+
+inline void Scheduler::insert(const Entry &entry)
+{
+	if(entry.tick <= current)
+	{
+		expired.push_back(entry);
+		return;
+	}
+
+	uint64_t delta = entry.tick - current;
+	unsigned level = 0;
+	while(level < Levels-1 && delta >= (uint64_t(1) << (SlotBits*(level+1))))
+		++level;
+
+	// Beyond the horizon, park in the last slot of the top level
+	uint64_t tick = entry.tick;
+	if(level == Levels-1 && delta >= (uint64_t(1) << (SlotBits*Levels)))
+		tick = current + (uint64_t(1) << (SlotBits*Levels)) - 1;
+
+	wheel[level][(tick >> (SlotBits*level)) & (Slots-1)].push_back(entry);
+	++counts[level];
+}
+
+inline void Scheduler::cascade(unsigned level, size_t index)
+{
+	scratch.clear();
+	scratch.swap(wheel[level][index]);
+	counts[level]-= scratch.size();
+
+	for(const Entry &entry : scratch)
+	{
+		// Drop stale entries on the way
+		auto it = timers.find(entry.serial);
+		if(it != timers.end() && it->second.entryTick == entry.tick)
+			insert(entry);
+	}
+
+	scratch.clear();
+}
+
+inline void Scheduler::expire(std::vector<Entry> &entries, DueList &due)
+{
+	scratch.clear();
+	scratch.swap(entries);
+
+	for(const Entry &entry : scratch)
+	{
+		auto it = timers.find(entry.serial);
+		if(it == timers.end() || it->second.entryTick != entry.tick)
+			continue;	// cancelled or superseded
+
+		Timer &timer = it->second;
+		if(timer.tick > current)
+		{
+			// Postponed
+			timer.entryTick = timer.tick;
+			insert(Entry{entry.serial, timer.tick});
+			continue;
+		}
+
+		running[entry.serial] = std::thread::id();
+		due.emplace_back(entry.serial, std::move(timer.function));
+		timers.erase(it);
+	}
+
+	scratch.clear();
+}
+
+inline void Scheduler::advance(uint64_t target, DueList &due)
+{
+	while(current < target)
+	{
+		unsigned lowest = 0;
+		while(lowest < Levels && !counts[lowest])
+			++lowest;
+
+		if(lowest == Levels)
+		{
+			current = target;
+			break;
+		}
+
+		// Nothing can expire before the next block of the lowest non-empty level
+		if(lowest > 0)
+		{
+			uint64_t last = current | ((uint64_t(1) << (SlotBits*lowest)) - 1);
+			if(last >= target)
+			{
+				current = target;
+				break;
+			}
+
+			current = last;
+		}
+
+		++current;
+
+		// Cascade levels whose index changed, from the highest one
+		unsigned top = 0;
+		while(top+1 < Levels && (current & ((uint64_t(1) << (SlotBits*(top+1))) - 1)) == 0)
+			++top;
+
+		for(unsigned l=top; l>=1; --l)
+			cascade(l, (current >> (SlotBits*l)) & (Slots-1));
+
+		std::vector<Entry> &slot = wheel[0][current & (Slots-1)];
+		counts[0]-= slot.size();
+		expire(slot, due);
+	}
+
+	if(!expired.empty())
+		expire(expired, due);
+}
+
+inline uint64_t Scheduler::nextTick(void) const
+{
+	if(!expired.empty())
+		return current;
+
+	uint64_t next = std::numeric_limits<uint64_t>::max();
+	for(unsigned l=0; l<Levels; ++l)
+	{
+		if(!counts[l]) continue;
+
+		// On upper levels, the slot at offset 0 is the next revolution
+		uint64_t base = current >> (SlotBits*l);
+		uint64_t last = (l > 0 ? Slots : Slots-1);
+		for(uint64_t i=1; i<=last; ++i)
+			if(!wheel[l][(base+i) & (Slots-1)].empty())
+			{
+				next = std::min(next, (base+i) << (SlotBits*l));
+				break;
+			}
+
+		Assert(next != std::numeric_limits<uint64_t>::max());	// armed entries must wake the thread
+	}
+
+	return next;
+}
+
 }
 
 #endif
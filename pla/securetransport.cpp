@@ -33,21 +33,45 @@ duration SecureTransport::DefaultTimeout = seconds(10.);	// Defaults to 10 secs
 
 // Force 128+ bits cipher, disable SSL3.0 and TLS1.0, disable RC4
 String SecureTransport::DefaultPriorities = "SECURE128:-VERS-SSL3.0:-VERS-TLS1.0:-ARCFOUR-128";
+const size_t SecureTransport::MaxCachedSessions = 256;
 gnutls_dh_params_t SecureTransport::Params;
 std::mutex SecureTransport::ParamsMutex;
+gnutls_datum_t SecureTransport::TicketKey = { NULL, 0 };
+Map<BinaryString, BinaryString> SecureTransport::Sessions;
+List<BinaryString> SecureTransport::SessionsOrder;
+uint64_t SecureTransport::FullHandshakesCount = 0;
+uint64_t SecureTransport::ResumedHandshakesCount = 0;
+std::mutex SecureTransport::SessionsMutex;
 
 void SecureTransport::Init(void)
 {
 	Assert(gnutls_global_init() == GNUTLS_E_SUCCESS);
 	Assert(gnutls_dh_params_init(&Params) == GNUTLS_E_SUCCESS);
+	Assert(gnutls_session_ticket_key_generate(&TicketKey) == GNUTLS_E_SUCCESS);
 }
 
 void SecureTransport::Cleanup(void)
 {
+	gnutls_free(TicketKey.data);
+	TicketKey.data = NULL;
+	TicketKey.size = 0;
+
 	gnutls_global_deinit();
 	gnutls_dh_params_deinit(Params);
 }
 
+uint64_t SecureTransport::FullHandshakes(void)
+{
+	std::unique_lock<std::mutex> lock(SessionsMutex);
+	return FullHandshakesCount;
+}
+
+uint64_t SecureTransport::ResumedHandshakes(void)
+{
+	std::unique_lock<std::mutex> lock(SessionsMutex);
+	return ResumedHandshakesCount;
+}
+
 void SecureTransport::GenerateParams(void)
 {
 	const int bits = 4096;
@@ -65,6 +89,7 @@ SecureTransport::SecureTransport(Stream *stream, bool server) :
 	mBuffer(NULL),
 	mBufferSize(0),
 	mBufferOffset(0),
+	mIsCorked(false),
 	mIsHandshakeDone(false),
 	mIsByeDone(false)
 {
@@ -95,6 +120,9 @@ SecureTransport::SecureTransport(Stream *stream, bool server) :
 			mBuffer = new char[DatagramSocket::MaxDatagramSize];
 			setDatagramMtu(1452);	// Defaults to UDP over IPv6 on ethernet
 		}
+		else {
+			mBuffer = new char[BufferSize];
+		}
 	}
 	catch(...)
 	{
@@ -164,6 +192,15 @@ void SecureTransport::handshake(void)
 		 // Set server name
 		if(!mHostname.empty())
 			gnutls_server_name_set(mSession, GNUTLS_NAME_DNS, mHostname.data(), mHostname.size());
+
+		// Try to resume a previous session
+		if(!mSessionKey.empty())
+		{
+			std::unique_lock<std::mutex> lock(SessionsMutex);
+			auto it = Sessions.find(mSessionKey);
+			if(it != Sessions.end())
+				gnutls_session_set_data(mSession, it->second.data(), it->second.size());
+		}
 	}
 
 	// Perform the TLS handshake
@@ -180,14 +217,37 @@ void SecureTransport::handshake(void)
 		else throw Exception(String("TLS handshake failed: ") + ErrorString(ret));
 	}
 
+	if(isResumed())
+	{
+		// Certificate callback is skipped on resumption, verify the restored peer certificate
+		if(hasCertificate() && CertificateCallback(mSession) != 0)
+			throw Exception("TLS handshake failed: resumed session verification failed");
+
+		std::unique_lock<std::mutex> lock(SessionsMutex);
+		++ResumedHandshakesCount;
+	}
+	else {
+		std::unique_lock<std::mutex> lock(SessionsMutex);
+		++FullHandshakesCount;
+	}
+
 	mIsHandshakeDone = true;
 	mIsByeDone = false;
+
+	storeSession();
 }
 
 void SecureTransport::close(void)
 {
 	if(!mIsByeDone)
 	{
+		// Send corked data
+		if(!isDatagram() && !mWriteBuffer.empty())
+			NOEXCEPTION(flush());
+
+		// Session tickets may have been received since handshake
+		storeSession();
+
 		int ret;
 		do {
 			ret = gnutls_bye(mSession, GNUTLS_SHUT_RDWR);
@@ -209,6 +269,14 @@ void SecureTransport::setHostname(const String &hostname)
 	mHostname = hostname;
 }
 
+void SecureTransport::setSessionKey(const BinaryString &key)
+{
+	if(isHandshakeDone())
+		throw Exception("Unable to set secure transport session key: handshake is done");
+
+	mSessionKey = key;
+}
+
 bool SecureTransport::isClient(void) const
 {
 	return true;
@@ -219,6 +287,11 @@ bool SecureTransport::isHandshakeDone(void) const
 	return mIsHandshakeDone;
 }
 
+bool SecureTransport::isResumed(void) const
+{
+	return gnutls_session_is_resumed(mSession) != 0;
+}
+
 bool SecureTransport::isAnonymous(void) const
 {
 	return gnutls_auth_get_type(mSession) == GNUTLS_CRD_ANON;
@@ -276,9 +349,22 @@ size_t SecureTransport::readData(char *buffer, size_t size)
 		return size;
 	}
 	else {
+		if(mBufferOffset < mBufferSize)
+		{
+			size = std::min(size, mBufferSize - mBufferOffset);
+			std::memcpy(buffer, mBuffer + mBufferOffset, size);
+			mBufferOffset+= size;
+			return size;
+		}
+
+		// Small reads go through the read-ahead buffer
+		bool buffered = (size < BufferSize);
+		char *target = (buffered ? mBuffer : buffer);
+		size_t len = (buffered ? BufferSize : size);
+
 		ssize_t ret;
 		do {
-			ret = gnutls_record_recv(mSession, buffer, size);
+			ret = gnutls_record_recv(mSession, target, len);
 		}
 		while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_REHANDSHAKE);
 
@@ -286,7 +372,11 @@ size_t SecureTransport::readData(char *buffer, size_t size)
 		if(ret == GNUTLS_E_PREMATURE_TERMINATION) return 0;
 		if(ret < 0) throw Exception(ErrorString(ret));
 
-		return size_t(ret);
+		if(!buffered || ret == 0) return size_t(ret);
+
+		mBufferSize = size_t(ret);
+		mBufferOffset = 0;
+		return readData(buffer, size);
 	}
 }
 
@@ -298,22 +388,24 @@ void SecureTransport::writeData(const char *data, size_t size)
 	{
 		mWriteBuffer.writeBinary(data, size);
 	}
+	else if(mIsCorked)
+	{
+		// Send as soon as a full record is available
+		mWriteBuffer.writeBinary(data, size);
+		if(mWriteBuffer.size() >= BufferSize*4)
+			flush();
+	}
 	else {
-		do {
-			ssize_t ret;
-			do {
-				ret = gnutls_record_send(mSession, data, size);
-			}
-			while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN);
+		sendRecords(data, size);
+	}
+}
 
-			if(ret < 0) throw Exception(ErrorString(ret));
+bool SecureTransport::waitData(duration timeout)
+{
+	if(mBufferOffset < mBufferSize || gnutls_record_check_pending(mSession))
+		return true;
 
-			Assert(size_t(ret) <= size);
-			data+= ret;
-			size-= ret;
-		}
-		while(size);
-	}
+	return mStream->waitData(timeout);
 }
 
 bool SecureTransport::nextRead(void)
@@ -329,7 +421,10 @@ bool SecureTransport::nextRead(void)
 bool SecureTransport::nextWrite(void)
 {
 	if(!isDatagram())
+	{
+		flush();
 		return false;
+	}
 
 	ssize_t ret;
 	do {
@@ -343,6 +438,68 @@ bool SecureTransport::nextWrite(void)
 	return true;
 }
 
+void SecureTransport::flush(void)
+{
+	if(isDatagram() || mWriteBuffer.empty())
+		return;
+
+	sendRecords(mWriteBuffer.data(), mWriteBuffer.size());
+	mWriteBuffer.clear();
+}
+
+void SecureTransport::cork(void)
+{
+	mIsCorked = true;
+}
+
+void SecureTransport::uncork(void)
+{
+	mIsCorked = false;
+	flush();
+}
+
+void SecureTransport::sendRecords(const char *data, size_t size)
+{
+	while(size)
+	{
+		ssize_t ret;
+		do {
+			ret = gnutls_record_send(mSession, data, size);
+		}
+		while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN);
+
+		if(ret < 0) throw Exception(ErrorString(ret));
+
+		Assert(size_t(ret) <= size);
+		data+= ret;
+		size-= ret;
+	}
+}
+
+void SecureTransport::storeSession(void)
+{
+	if(!isClient() || mSessionKey.empty() || !mIsHandshakeDone)
+		return;
+
+	gnutls_datum_t data;
+	if(gnutls_session_get_data2(mSession, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	BinaryString session(reinterpret_cast<const char*>(data.data), data.size);
+	gnutls_free(data.data);
+
+	std::unique_lock<std::mutex> lock(SessionsMutex);
+	Sessions[mSessionKey] = session;
+	SessionsOrder.remove(mSessionKey);
+	SessionsOrder.push_back(mSessionKey);
+
+	while(SessionsOrder.size() > MaxCachedSessions)
+	{
+		Sessions.erase(SessionsOrder.front());
+		SessionsOrder.pop_front();
+	}
+}
+
 bool SecureTransport::isDatagram(void) const
 {
 	return mStream->isDatagram();
@@ -809,6 +966,7 @@ SecureTransportServer::SecureTransportServer(Stream *stream, Credentials *creds,
 {
 	try {
 		gnutls_handshake_set_post_client_hello_function(mSession, PostClientHelloCallback);
+		gnutls_session_ticket_enable_server(mSession, &TicketKey);
 
 		if(requestClientCertificate)
 		{
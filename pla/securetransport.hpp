@@ -26,6 +26,7 @@
 #include "pla/stream.hpp"
 #include "pla/string.hpp"
 #include "pla/list.hpp"
+#include "pla/map.hpp"
 #include "pla/crypto.hpp"
 #include "pla/serversocket.hpp"
 #include "pla/datagramsocket.hpp"
@@ -42,11 +43,16 @@ class SecureTransport : public Stream
 public:
 	static duration DefaultTimeout;
 	static String DefaultPriorities;
+	static const size_t MaxCachedSessions;
 
 	static void Init(void);
 	static void Cleanup(void);
 	static void GenerateParams(void);
 
+	// Handshake counters
+	static uint64_t FullHandshakes(void);
+	static uint64_t ResumedHandshakes(void);
+
 	class Credentials
 	{
 	public:
@@ -102,9 +108,11 @@ public:
 	void close(void);
 
 	void setHostname(const String &hostname);	// remote hostname for client
+	void setSessionKey(const BinaryString &key);	// client sessions with the same key will be resumed
 
 	virtual bool isClient(void) const;
 	bool isHandshakeDone(void) const;
+	bool isResumed(void) const;
 	bool isAnonymous(void) const;
 	bool hasPrivateSharedKey(void) const;
 	bool hasCertificate(void) const;
@@ -112,9 +120,12 @@ public:
 
 	size_t readData(char *buffer, size_t size);
 	void writeData(const char *data, size_t size);
-	// TODO: waitData
+	bool waitData(duration timeout);
 	bool nextRead(void);
 	bool nextWrite(void);
+	void flush(void);
+	void cork(void);	// in stream mode, send coalesced writes as a single record
+	void uncork(void);
 	bool isDatagram(void) const;
 
 	struct Verifier
@@ -139,9 +150,20 @@ protected:
 
 	static String ErrorString(int code);
 
+	void sendRecords(const char *data, size_t size);
+
 	static gnutls_dh_params_t Params;
 	static std::mutex ParamsMutex;
 
+	// Session resumption, with tickets on server side and a bounded cache on client side
+	static gnutls_datum_t TicketKey;
+	static Map<BinaryString, BinaryString> Sessions;
+	static List<BinaryString> SessionsOrder;	// least recently used first
+	static uint64_t FullHandshakesCount, ResumedHandshakesCount;
+	static std::mutex SessionsMutex;
+
+	void storeSession(void);
+
 	SecureTransport(Stream *stream, bool server);	// stream will be deleted on success
 
 	gnutls_session_t mSession;
@@ -149,11 +171,13 @@ protected:
 	Verifier *mVerifier;
 	String mPriorities;
 	String mHostname;
+	BinaryString mSessionKey;
 
-	// For datagram mode
+	// Record buffer in datagram mode, read-ahead buffer in stream mode
 	char *mBuffer;
 	size_t mBufferSize, mBufferOffset;
-	BinaryString mWriteBuffer;
+	BinaryString mWriteBuffer;	// datagram being written, or corked data in stream mode
+	bool mIsCorked;
 
 	List<Credentials*> mCredsToDelete;
 	bool mIsHandshakeDone;
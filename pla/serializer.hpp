@@ -273,7 +273,7 @@ bool Serializer::read(std::map<K, V> &container)
 		auto it = container.find(p.first); // check if key already exists
 		if(it != container.end())
 		{
-			read(it->second);
+			if(!read(it->second)) return false;	// expected value is malformed
 		}
 		else {
 			if(read(p.second)) container.emplace(p);
@@ -23,6 +23,11 @@
 #include "pla/exception.hpp"
 #include "pla/http.hpp"
 #include "pla/proxy.hpp"
+#include "pla/file.hpp"
+
+#ifdef LINUX
+#include <sys/sendfile.h>
+#endif
 
 namespace pla
 {
@@ -33,6 +38,19 @@ void Socket::Transfer(Socket *sock1, Socket *sock2)
 	Assert(sock2);
 	char buffer[BufferSize];
 
+	// Forward read-ahead data first
+	if(sock1->mReadOffset < sock1->mReadSize)
+	{
+		sock2->writeData(sock1->mReadBuffer + sock1->mReadOffset, sock1->mReadSize - sock1->mReadOffset);
+		sock1->mReadOffset = sock1->mReadSize = 0;
+	}
+
+	if(sock2->mReadOffset < sock2->mReadSize)
+	{
+		sock1->writeData(sock2->mReadBuffer + sock2->mReadOffset, sock2->mReadSize - sock2->mReadOffset);
+		sock2->mReadOffset = sock2->mReadSize = 0;
+	}
+
 	while(true)
 	{
 		fd_set readfds;
@@ -69,7 +87,9 @@ Socket::Socket(void) :
 		mSock(INVALID_SOCKET),
 		mConnectTimeout(seconds(-1.)),
 		mReadTimeout(seconds(-1.)),
-		mWriteTimeout(seconds(-1.))
+		mWriteTimeout(seconds(-1.)),
+		mReadOffset(0),
+		mReadSize(0)
 {
 
 }
@@ -78,7 +98,9 @@ Socket::Socket(const Address &a, duration timeout) :
 	mSock(INVALID_SOCKET),
 	mConnectTimeout(seconds(-1.)),
 	mReadTimeout(seconds(-1.)),
-	mWriteTimeout(seconds(-1.))
+	mWriteTimeout(seconds(-1.)),
+	mReadOffset(0),
+	mReadSize(0)
 {
 	setTimeout(timeout);
 	connect(a);
@@ -87,7 +109,9 @@ Socket::Socket(const Address &a, duration timeout) :
 Socket::Socket(socket_t sock) :
 	mConnectTimeout(seconds(-1.)),
 	mReadTimeout(seconds(-1.)),
-	mWriteTimeout(seconds(-1.))
+	mWriteTimeout(seconds(-1.)),
+	mReadOffset(0),
+	mReadSize(0)
 {
 	mSock = sock;
 }
@@ -105,6 +129,7 @@ bool Socket::isConnected(void) const
 bool Socket::isReadable(void) const
 {
 	if(!isConnected()) return false;
+	if(mReadOffset < mReadSize) return true;
 
 	fd_set readfds;
 	FD_ZERO(&readfds);
@@ -269,11 +294,26 @@ void Socket::close(void)
 	}
 
 	mProxifiedAddr.clear();
+	mReadOffset = mReadSize = 0;
 }
 
 size_t Socket::readData(char *buffer, size_t size)
 {
-	return recvData(buffer, size, 0);
+	if(mReadOffset == mReadSize)
+	{
+		// Large reads bypass the buffer
+		if(size >= BufferSize)
+			return recvData(buffer, size, 0);
+
+		mReadOffset = 0;
+		mReadSize = 0;
+		mReadSize = recvData(mReadBuffer, BufferSize, 0);
+	}
+
+	size = std::min(size, mReadSize - mReadOffset);
+	std::memcpy(buffer, mReadBuffer + mReadOffset, size);
+	mReadOffset+= size;
+	return size;
 }
 
 void Socket::writeData(const char *data, size_t size)
@@ -286,6 +326,9 @@ bool Socket::waitData(duration timeout)
 	if(mSock == INVALID_SOCKET)
 		throw NetException("Socket is closed");
 
+	if(mReadOffset < mReadSize)
+		return true;
+
 	fd_set readfds;
 	FD_ZERO(&readfds);
 	FD_SET(mSock, &readfds);
@@ -297,9 +340,83 @@ bool Socket::waitData(duration timeout)
 	return (ret != 0);
 }
 
+int64_t Socket::writeFile(File &file, int64_t max)
+{
+#ifdef LINUX
+	int fd = ::open(file.name().pathEncode().c_str(), O_RDONLY);
+	if(fd < 0) return Stream::writeFile(file, max);
+
+	struct timeval tv;
+	durationToStruct(std::max(mWriteTimeout, duration::zero()), tv);
+
+	off_t offset = off_t(file.tellRead());
+	int64_t left = max;
+	try {
+		while(left)
+		{
+			if(mSock == INVALID_SOCKET)
+				throw NetException("Socket is closed");
+
+			if(mWriteTimeout >= duration::zero())
+			{
+				fd_set writefds;
+				FD_ZERO(&writefds);
+				FD_SET(mSock, &writefds);
+
+				int ret = ::select(SOCK_TO_INT(mSock)+1, NULL, &writefds, NULL, &tv);
+				if (ret == -1)
+					throw Exception("Unable to wait on socket");
+				if (ret == 0)
+					throw Timeout();
+			}
+
+			// Send by slices so the write timeout is still enforced
+			ssize_t count = ::sendfile(mSock, fd, &offset, size_t(std::min(left, int64_t(1024*1024))));
+			if(count < 0)
+			{
+				if(errno == EINTR || errno == EAGAIN) continue;
+				throw NetException("Connection lost (error " + String::number(sockerrno) + ")");
+			}
+
+			if(count == 0) break;	// end of file
+			left-= count;
+		}
+	}
+	catch(...)
+	{
+		::close(fd);
+		throw;
+	}
+
+	::close(fd);
+	file.seekRead(int64_t(offset));
+	return max - left;
+#else
+	return Stream::writeFile(file, max);
+#endif
+}
+
 size_t Socket::peekData(char *buffer, size_t size)
 {
-	return recvData(buffer, size, MSG_PEEK);
+	if(mReadOffset == mReadSize)
+	{
+		mReadOffset = 0;
+		mReadSize = 0;
+	}
+
+	size = std::min(size, BufferSize);
+	if(mReadSize - mReadOffset < size)
+	{
+		// Move pending data to the front and read ahead
+		std::memmove(mReadBuffer, mReadBuffer + mReadOffset, mReadSize - mReadOffset);
+		mReadSize-= mReadOffset;
+		mReadOffset = 0;
+		mReadSize+= recvData(mReadBuffer + mReadSize, BufferSize - mReadSize, 0);
+	}
+
+	size = std::min(size, mReadSize - mReadOffset);
+	std::memcpy(buffer, mReadBuffer + mReadOffset, size);
+	return size;
 }
 
 size_t Socket::recvData(char *buffer, size_t size, int flags)
@@ -60,6 +60,7 @@ public:
 	size_t readData(char *buffer, size_t size);
 	void writeData(const char *data, size_t size);
 	bool waitData(duration timeout);
+	int64_t writeFile(File &file, int64_t max);
 
 	// Socket-specific
 	size_t peekData(char *buffer, size_t size);
@@ -72,6 +73,10 @@ private:
 	duration mConnectTimeout, mReadTimeout, mWriteTimeout;
 	Address mProxifiedAddr;
 
+	// Read-ahead buffer, so small reads don't cost one syscall each
+	char mReadBuffer[BufferSize];
+	size_t mReadOffset, mReadSize;
+
 	friend class ServerSocket;
 	friend class SocketSelect;
 };
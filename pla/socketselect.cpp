@@ -34,6 +34,7 @@ SocketSelect::SocketSelect(void) :
 		{
 			fd_set readfds;
 			int maxfd;
+			bool pending = false;
 			{
 				std::unique_lock<std::mutex> lock(mMutex);
 				if(mJoining) break;
@@ -45,22 +46,23 @@ SocketSelect::SocketSelect(void) :
 				{
 					FD_SET(p.first->mSock, &readfds);
 					maxfd = std::max(maxfd, SOCK_TO_INT(p.first->mSock));
+					if(p.first->mReadOffset < p.first->mReadSize) pending = true;	// read-ahead data
 				}
 			}
 
 			struct timeval tv;
 			tv.tv_sec = 0;
-			tv.tv_usec = 100000;	// 100ms
+			tv.tv_usec = (pending ? 0 : 100000);	// 100ms
 			int n = ::select(maxfd, &readfds, NULL, NULL, &tv);
 			if (n < 0) throw Exception("Select failed on sockets");
 
-			if(n)
+			if(n || pending)
 			{
 				std::unique_lock<std::mutex> lock(mMutex);
 
 				for(auto &p : mSockets)
 				{
-					if(FD_ISSET(p.first->mSock, &readfds))
+					if(FD_ISSET(p.first->mSock, &readfds) || p.first->mReadOffset < p.first->mReadSize)
 					{
 						// Call reader
 						p.second(p.first);
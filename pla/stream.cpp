@@ -23,6 +23,7 @@
 #include "pla/string.hpp"
 #include "pla/serializable.hpp"
 #include "pla/exception.hpp"
+#include "pla/file.hpp"
 
 namespace pla
 {
@@ -80,6 +81,16 @@ void Stream::flush(void)
 	// do nothing
 }
 
+void Stream::cork(void)
+{
+	// do nothing
+}
+
+void Stream::uncork(void)
+{
+	// do nothing
+}
+
 void Stream::close(void)
 {
 	// do nothing
@@ -136,6 +147,11 @@ size_t Stream::writeData(Stream &s, size_t max)
 	return max-left;
 }
 
+int64_t Stream::writeFile(File &file, int64_t max)
+{
+	return write(file, max);
+}
+
 bool Stream::hexaMode(void)
 {
 	return mHexa;
@@ -478,33 +494,33 @@ bool Stream::readBinary(uint8_t &i)
 
 bool Stream::readBinary(uint16_t &i)
 {
-	if(!readBinary(reinterpret_cast<char*>(&i),2)) return false;
+	if(readBinary(reinterpret_cast<char*>(&i),2) != 2) return false;	// truncated
 	i = fixEndianess(i);
 	return true;
 }
 
 bool Stream::readBinary(uint32_t &i)
 {
-	if(!readBinary(reinterpret_cast<char*>(&i),4)) return false;
+	if(readBinary(reinterpret_cast<char*>(&i),4) != 4) return false;	// truncated
 	i = fixEndianess(i);
 	return true;
 }
 
 bool Stream::readBinary(uint64_t &i)
 {
-	if(!readBinary(reinterpret_cast<char*>(&i),8)) return false;
+	if(readBinary(reinterpret_cast<char*>(&i),8) != 8) return false;	// truncated
 	i = fixEndianess(i);
 	return true;
 }
 
 bool Stream::readBinary(float32_t &f)
 {
-	return readBinary(reinterpret_cast<char*>(&f),4);
+	return readBinary(reinterpret_cast<char*>(&f),4) == 4;
 }
 
 bool Stream::readBinary(float64_t &f)
 {
-	return readBinary(reinterpret_cast<char*>(&f),8);
+	return readBinary(reinterpret_cast<char*>(&f),8) == 8;
 }
 
 void Stream::writeBinary(const BinaryString &str)
@@ -33,6 +33,7 @@ class Serializable;
 class BinaryString;
 class String;
 class Pipe;
+class File;
 
 class Stream
 {
@@ -62,12 +63,15 @@ public:
 	virtual void clear(void);
 	virtual void flush(void);
 	virtual void close(void);
+	virtual void cork(void);	// coalesce writes until uncork(), flush() or nextWrite()
+	virtual void uncork(void);
 	virtual bool ignore(size_t size = 1);
 	virtual bool skipMark(void);
 	virtual bool isDatagram(void) const;
 
 	size_t readData(Stream &s, size_t max);
 	size_t writeData(Stream &s, size_t max);
+	virtual int64_t writeFile(File &file, int64_t max);	// from the current read position, zero-copy if supported
 	inline void discard(void) { clear(); }
 
 	// Atomic
@@ -23,7 +23,7 @@
 #define PLA_THREADPOOL_H
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -32,61 +32,198 @@
 #include <functional>
 #include <stdexcept>
 #include <chrono>
+#include <atomic>
+#include <type_traits>
+#include <cstddef>
 
 #include "pla/include.hpp"
 
 namespace pla
 {
 
+// Work-stealing pool: each worker has its own deque, tasks submitted from outside
+// the pool go through a bounded injection queue
 class ThreadPool
 {
 public:
-	ThreadPool(size_t threads);	// TODO: max tasks in queue
+	static const size_t MaxQueuedTasks = 65536;	// injection queue capacity
+
+	ThreadPool(size_t threads);
 	virtual ~ThreadPool(void);
 
 	template<class F, class... Args>
 	auto enqueue(F&& f, Args&&... args)
 		-> std::future<typename std::result_of<F(Args...)>::type>;
 
+	// Fire and forget, exceptions are logged
+	template<class F>
+	void post(F&& f);
+	template<class F, class... Args>
+	void post(F&& f, Args&&... args);
+
 	virtual void clear(void);
 	virtual void join(void);
 
 protected:
-	std::vector<std::thread > workers;
-	std::queue<std::function<void()> > tasks;
+	// Move-only callable, small functors are stored inline without allocation
+	class Task
+	{
+	public:
+		Task(void) : manager(NULL) {}
 
-	std::mutex mutex;
-	std::condition_variable condition;
-	bool joining;
-};
+		template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+		Task(F &&f)
+		{
+			typedef typename std::decay<F>::type Functor;
+			Manager<Functor>::Create(storage, std::forward<F>(f));
+			manager = &Manager<Functor>::Manage;
+		}
 
-inline ThreadPool::ThreadPool(size_t threads) : joining(false)
-{
-	for(size_t i=0; i<threads; ++i)
-	{
-		workers.emplace_back([this]
+		Task(Task &&t) : manager(t.manager)
+		{
+			if(manager) manager(Move, storage, &t.storage);
+			t.manager = NULL;
+		}
+
+		~Task(void)
+		{
+			reset();
+		}
+
+		Task &operator=(Task &&t)
+		{
+			if(this != &t)
+			{
+				reset();
+				manager = t.manager;
+				if(manager) manager(Move, storage, &t.storage);
+				t.manager = NULL;
+			}
+			return *this;
+		}
+
+		void operator()(void)
+		{
+			manager(Call, storage, NULL);
+		}
+
+		explicit operator bool(void) const
+		{
+			return manager != NULL;
+		}
+
+	private:
+		static const size_t InlineSize = 48;
+		typedef typename std::aligned_storage<InlineSize, alignof(std::max_align_t)>::type Storage;
+		enum Operation { Call, Move, Destroy };
+
+		template<class Functor, bool Inline = (sizeof(Functor) <= InlineSize
+			&& alignof(Functor) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<Functor>::value)>
+		struct Manager
 		{
-			while(true)
+			template<class F> static void Create(Storage &s, F &&f)
+			{
+				new(&s) Functor(std::forward<F>(f));
+			}
+
+			static void Manage(Operation op, Storage &s, Storage *other)
 			{
-				try {
-					std::function<void()> task;
-					{
-						std::unique_lock<std::mutex> lock(mutex);
-						condition.wait(lock, [this]() {
-							return !tasks.empty() || joining;
-						});
-						if(tasks.empty()) break;
-						task = std::move(tasks.front());
-						tasks.pop();
-					}
-
-					task();
+				Functor *f = reinterpret_cast<Functor*>(&s);
+				switch(op)
+				{
+				case Call:
+					(*f)();
+					break;
+				case Move:
+					new(&s) Functor(std::move(*reinterpret_cast<Functor*>(other)));
+					reinterpret_cast<Functor*>(other)->~Functor();
+					break;
+				case Destroy:
+					f->~Functor();
+					break;
 				}
-				catch(const std::exception &e)
+			}
+		};
+
+		template<class Functor>
+		struct Manager<Functor, false>
+		{
+			template<class F> static void Create(Storage &s, F &&f)
+			{
+				*reinterpret_cast<Functor**>(&s) = new Functor(std::forward<F>(f));
+			}
+
+			static void Manage(Operation op, Storage &s, Storage *other)
+			{
+				Functor *&f = *reinterpret_cast<Functor**>(&s);
+				switch(op)
 				{
-					LogWarn("ThreadPool", std::string("Unhandled exception: ") + e.what());
+				case Call:
+					(*f)();
+					break;
+				case Move:
+					f = *reinterpret_cast<Functor**>(other);
+					break;
+				case Destroy:
+					delete f;
+					break;
 				}
 			}
+		};
+
+		void reset(void)
+		{
+			if(manager) manager(Destroy, storage, NULL);
+			manager = NULL;
+		}
+
+		Storage storage;
+		void (*manager)(Operation, Storage&, Storage*);
+	};
+
+	void submit(Task &&task, bool bounded = true);
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;	// for derived classes
+	std::atomic<bool> joining;
+
+private:
+	struct Local
+	{
+		std::deque<Task> tasks;
+		std::mutex mutex;
+	};
+
+	static std::pair<ThreadPool*, size_t> &Current(void);
+
+	bool pop(size_t index, Task &task, bool injectedFirst);
+	void run(size_t index);
+
+	std::vector<std::unique_ptr<Local> > locals;
+	std::deque<Task> injected;
+	std::mutex injectedMutex;
+	std::condition_variable notFull;
+
+	std::atomic<size_t> queued;	// tasks in all queues
+	std::atomic<unsigned> sleepers;
+	std::mutex sleepMutex;
+	std::condition_variable wakeCondition;
+};
+
+inline ThreadPool::ThreadPool(size_t threads) :
+	joining(false),
+	queued(0),
+	sleepers(0)
+{
+	for(size_t i=0; i<threads; ++i)
+		locals.emplace_back(new Local);
+
+	for(size_t i=0; i<threads; ++i)
+	{
+		workers.emplace_back([this, i]
+		{
+			run(i);
 		});
 	}
 }
@@ -104,33 +241,44 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
 {
 	using type = typename std::result_of<F(Args...)>::type;
 
-	auto task = std::make_shared< std::packaged_task<type()> >(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-	std::future<type> result = task->get_future();
+	if(joining) throw std::runtime_error("enqueue on closing ThreadPool");
 
-	{
-		std::unique_lock<std::mutex> lock(mutex);
-		if(joining) throw std::runtime_error("enqueue on closing ThreadPool");
+	// The task is move-only, so it is stored directly instead of in a shared_ptr
+	std::packaged_task<type()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+	std::future<type> result = task.get_future();
+	submit(Task(std::move(task)));
+	return result;
+}
 
-		// Add task
-		tasks.emplace([task]() {
-			(*task)();
-		});
+template<class F>
+void ThreadPool::post(F&& f)
+{
+	if(joining) throw std::runtime_error("post on closing ThreadPool");
 
-		condition.notify_one();
-	}
+	submit(Task(std::forward<F>(f)));
+}
 
-	return result;
+template<class F, class... Args>
+void ThreadPool::post(F&& f, Args&&... args)
+{
+	post(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 }
 
 inline void ThreadPool::clear(void)
 {
 	{
-		std::unique_lock<std::mutex> lock(mutex);
+		std::unique_lock<std::mutex> lock(injectedMutex);
+		queued-= injected.size();
+		injected.clear();
+	}
 
-		while(!tasks.empty())
-			tasks.pop();
+	notFull.notify_all();
 
-		//condition.notify_all();	// useless
+	for(auto &local : locals)
+	{
+		std::unique_lock<std::mutex> lock(local->mutex);
+		queued-= local->tasks.size();
+		local->tasks.clear();
 	}
 }
 
@@ -138,11 +286,140 @@ inline void ThreadPool::join(void)
 {
 	joining = true;
 
+	{
+		std::unique_lock<std::mutex> lock(sleepMutex);
+	}
+
+	wakeCondition.notify_all();
+	notFull.notify_all();
+
 	for(std::thread &w: workers)
 		if(w.joinable())
 			w.join();
 }
 
+inline void ThreadPool::submit(Task &&task, bool bounded)
+{
+	// Counted first so workers never see a negative count
+	++queued;
+
+	std::pair<ThreadPool*, size_t> &current = Current();
+	if(current.first == this)
+	{
+		// Submitted from a worker, push on its own deque
+		Local &local = *locals[current.second];
+		std::unique_lock<std::mutex> lock(local.mutex);
+		local.tasks.push_back(std::move(task));
+	}
+	else {
+		std::unique_lock<std::mutex> lock(injectedMutex);
+		if(bounded)
+		{
+			notFull.wait(lock, [this]() {
+				return injected.size() < MaxQueuedTasks || joining;
+			});
+		}
+
+		injected.push_back(std::move(task));
+	}
+
+	// Taking the lock ensures a worker about to sleep sees the task
+	if(sleepers > 0)
+	{
+		{
+			std::unique_lock<std::mutex> lock(sleepMutex);
+		}
+
+		wakeCondition.notify_one();
+	}
+}
+
+inline std::pair<ThreadPool*, size_t> &ThreadPool::Current(void)
+{
+	static thread_local std::pair<ThreadPool*, size_t> current(NULL, 0);
+	return current;
+}
+
+inline bool ThreadPool::pop(size_t index, Task &task, bool injectedFirst)
+{
+	Local &local = *locals[index];
+
+	auto popLocal = [&]()
+	{
+		// Most recent first for cache locality
+		std::unique_lock<std::mutex> lock(local.mutex);
+		if(local.tasks.empty()) return false;
+		task = std::move(local.tasks.back());
+		local.tasks.pop_back();
+		return true;
+	};
+
+	auto popInjected = [&]()
+	{
+		std::unique_lock<std::mutex> lock(injectedMutex);
+		if(injected.empty()) return false;
+		task = std::move(injected.front());
+		injected.pop_front();
+		lock.unlock();
+		notFull.notify_one();
+		return true;
+	};
+
+	bool success = false;
+	if(injectedFirst) success = popInjected() || popLocal();
+	else success = popLocal() || popInjected();
+
+	// Steal the oldest task from another worker
+	for(size_t i=1; !success && i<locals.size(); ++i)
+	{
+		Local &other = *locals[(index + i) % locals.size()];
+		std::unique_lock<std::mutex> lock(other.mutex);
+		if(!other.tasks.empty())
+		{
+			task = std::move(other.tasks.front());
+			other.tasks.pop_front();
+			success = true;
+		}
+	}
+
+	if(success) --queued;
+	return success;
+}
+
+inline void ThreadPool::run(size_t index)
+{
+	Current() = std::make_pair(this, index);
+
+	unsigned count = 0;
+	while(true)
+	{
+		try {
+			// Check the injection queue first from time to time so it can't starve
+			Task task;
+			if(pop(index, task, ++count % 61 == 0))
+			{
+				task();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			++sleepers;
+			wakeCondition.wait(lock, [this]() {
+				return queued > 0 || joining;
+			});
+			--sleepers;
+
+			if(joining && queued == 0) break;
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("ThreadPool", std::string("Unhandled exception: ") + e.what());
+		}
+	}
+
+	Current() = std::make_pair((ThreadPool*)NULL, size_t(0));
+}
+
 }
 
 #endif
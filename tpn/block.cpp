@@ -201,6 +201,17 @@ void Block::writeData(const char *data, size_t size)
 	throw Unsupported("Writing to Block");
 }
 
+int64_t Block::transfer(Stream &output, int64_t max)
+{
+	waitContent();
+
+	if(mCipher) return read(output, max);
+
+	int64_t left = mSize - tellRead();
+	if(left <= 0) return 0;
+	return output.writeFile(*mFile, std::min(left, max));
+}
+
 bool Block::waitData(duration timeout)
 {
 	if(!waitContent(timeout)) return false;
@@ -60,6 +60,8 @@ public:
 	void setDecryption(const BinaryString &key, const BinaryString &iv);
 	bool hasDecryption(void) const;
 
+	int64_t transfer(Stream &output, int64_t max);	// zero-copy if not encrypted
+
 	// Stream
 	size_t readData(char *buffer, size_t size);
 	void writeData(const char *data, size_t size);
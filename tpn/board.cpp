@@ -34,10 +34,20 @@
 namespace tpn
 {
 
+const unsigned Board::MaxSyncTasks = 3;
+const unsigned Board::CompactionThreshold = 32;
+const unsigned Board::MaxMails = 1024;
+const unsigned Board::MaxPagedListing = 256;
+const String Board::SnapshotSuffix = ".snapshot";
+
 Board::Board(const String &name, const String &secret, const String &displayName) :
 	mName(name),
 	mDisplayName(displayName),
 	mSecret(secret),
+	mPageSize(0),
+	mPaged(0),
+	mChained(0),
+	mSyncTasks(0),
 	mHasNew(false),
 	mUnread(0)
 {
@@ -54,8 +64,7 @@ Board::Board(const String &name, const String &secret, const String &displayName
 	for(auto it = digests.begin(); it != digests.end(); ++it)
 	{
 		//LogDebug("Board", "Retrieved digest: " + it->toString());
-		if(fetch(Network::Locator(prefix), *it, false))
-			incoming(Network::Locator(prefix), *it);
+		incoming(Network::Locator(prefix), *it);
 	}
 
 	publish(prefix);
@@ -64,6 +73,15 @@ Board::Board(const String &name, const String &secret, const String &displayName
 
 Board::~Board(void)
 {
+	{
+		// Wait for running sync tasks
+		std::unique_lock<std::mutex> lock(mMutex);
+		mSyncQueue.clear();
+		mSyncCondition.wait(lock, [this]() {
+			return mSyncTasks == 0;
+		});
+	}
+
 	for(auto board : mSubBoards)
 	{
 		std::unique_lock<std::mutex> lock(board->mMutex);
@@ -76,6 +94,9 @@ Board::~Board(void)
 
 	unpublish(prefix);
 	unsubscribe(prefix);
+
+	if(!mPageFileName.empty())
+		File::Remove(mPageFileName);
 }
 
 String Board::urlPrefix(void) const
@@ -127,8 +148,11 @@ bool Board::post(const Mail &mail)
 	const String prefix = "/mail/" + mName;
 
 	// Prevent double post
-	if(mMails.contains(mail.digest()))
-		return false;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mMails.contains(mail.digest()) || mPagedDigests.contains(mail.digest()))
+			return false;
+	}
 
 	// Add to chain
 	List<Mail> tmp;
@@ -178,6 +202,12 @@ void Board::add(const List<Mail> &mails)
 		mDigests.clear();
 		mDigests.insert(digest);
 		mProcessedDigests.insert(digest);
+
+		// Publish a snapshot once the chain is long enough, history must be complete
+		if(++mChained >= CompactionThreshold && !mSecret.empty() && mSyncQueue.empty() && mSyncTasks == 0)
+			compact();
+
+		page();
 	}
 	catch(const Exception &e)
 	{
@@ -190,7 +220,7 @@ void Board::add(const List<Mail> &mails)
 
 void Board::appendMail(const Mail &mail)
 {
-	if(mMails.contains(mail.digest()))
+	if(mMails.contains(mail.digest()) || mPagedDigests.contains(mail.digest()))
 		return;
 
 	// Insert
@@ -211,16 +241,16 @@ void Board::appendMail(const Mail &mail)
 			mOrphans.erase(it);
 		}
 
-		mCondition.notify_all();	// Notify HTTP clients
+		mWaiter.notify();	// Notify HTTP clients
 		for(auto b : mBoards)
 			b->appendMail(mail);		// Propagate
 	}
 	else {
-		if(mMails.contains(mail.parent()))
+		if(mMails.contains(mail.parent()) || mPagedDigests.contains(mail.parent()))
 		{
 			mListing.push_back(inserted);
 
-			mCondition.notify_all();	// Notify HTTP clients
+			mWaiter.notify();	// Notify HTTP clients
 			for(auto b : mBoards)
 				b->appendMail(mail);		// Propagate
 		}
@@ -231,6 +261,171 @@ void Board::appendMail(const Mail &mail)
 	}
 }
 
+bool Board::getMail(const BinaryString &digest, Mail &mail) const
+{
+	int64_t offset = 0;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		auto it = mMails.find(digest);
+		if(it != mMails.end())
+		{
+			mail = it->second;
+			return true;
+		}
+
+		if(!mPagedDigests.get(digest, offset))
+			return false;
+	}
+
+	// The page file is append-only, written records don't change
+	File pageFile(mPageFileName, File::Read);
+	pageFile.seekRead(offset);
+	BinarySerializer serializer(&pageFile);
+	return (serializer >> mail) && mail.digest() == digest;
+}
+
+void Board::compact(void)
+{
+	const String prefix = "/mail/" + mName;
+
+	Resource::Specs specs;
+	specs.name = mName + SnapshotSuffix;
+	specs.type = "mail";
+	specs.secret = mSecret;
+	for(auto d : mDigests)
+		specs.previousDigests.push_back(std::move(d));	// superseded heads
+
+	// The MAC covers superseded heads and digests of mails in listing order, paged mails first
+	Sha3_256 hash;
+	hash.init();
+	if(mPaged)
+	{
+		File pageFile(mPageFileName, File::Read);
+		BinarySerializer pageSerializer(&pageFile);
+		Mail m;
+		for(int i = 0; i < mPaged && (pageSerializer >> m); ++i)
+			hash.process(m.digest());
+	}
+
+	for(const Mail *m : mListing)
+		hash.process(m->digest());
+	for(auto &p : mOrphans)
+		for(const Mail *m : p.second)
+			hash.process(m->digest());
+
+	BinaryString mailsDigest;
+	hash.finalize(mailsDigest);
+
+	// Write the MAC then the full state
+	String tempFileName = File::TempName();
+	File tempFile(tempFileName, File::Truncate);
+	BinarySerializer serializer(&tempFile);
+	serializer << snapshotMac(specs.previousDigests, mailsDigest);
+	if(mPaged)
+	{
+		File pageFile(mPageFileName, File::Read);
+		tempFile.write(pageFile);
+		pageFile.close();
+	}
+
+	for(const Mail *m : mListing)
+		serializer << *m;
+	for(auto &p : mOrphans)
+		for(const Mail *m : p.second)
+			serializer << *m;
+	tempFile.close();
+
+	Resource resource;
+	resource.cache(tempFileName, specs);
+
+	BinaryString digest = resource.digest();
+	Store::Instance->storeValue(Store::Hash(prefix), digest, Store::Permanent);
+	for(const BinaryString &d : mDigests)
+		Store::Instance->eraseValue(Store::Hash(prefix), d);
+
+	LogDebug("Board::compact", "Published snapshot for " + mName + " (" + String::number(mPaged + int(mListing.size())) + " mails)");
+
+	mPreviousDigests.insertAll(mDigests);
+	mDigests.clear();
+	mDigests.insert(digest);
+	mProcessedDigests.insert(digest);
+	mChained = 0;
+}
+
+BinaryString Board::snapshotMac(const List<BinaryString> &previous, const BinaryString &mailsDigest) const
+{
+	BinaryString message;
+	message.writeBinary(String("snapshot:") + mName);
+	for(const BinaryString &d : previous)
+		message.writeBinary(d);
+	message.writeBinary(mailsDigest);
+
+	BinaryString mac;
+	Sha3_256().mac(message, BinaryString(mSecret), mac);
+	return mac;
+}
+
+void Board::page(void)
+{
+	if(mListing.size() <= MaxMails)
+		return;
+
+	if(mPageFileName.empty())
+		mPageFileName = File::TempName();
+
+	// Page out the oldest mails, leaving room for new ones
+	int count = int(mListing.size() - MaxMails*3/4);
+	File pageFile(mPageFileName, File::Append);
+	for(int i = 0; i < count; ++i)
+	{
+		BinaryString data;
+		BinarySerializer serializer(&data);
+		serializer << *mListing[i];
+		pageFile.writeBinary(data.data(), data.size());
+
+		BinaryString digest = mListing[i]->digest();
+		mPagedDigests.insert(digest, mPageSize);
+		mPagedOffsets.push_back(mPageSize);
+		mMails.erase(digest);
+		mPageSize+= data.size();
+	}
+	pageFile.close();
+
+	mListing.erase(0, count);
+	mPaged+= count;
+}
+
+void Board::readPaged(int from, int count, Array<Mail> &mails) const
+{
+	mails.clear();
+	count = std::min(count, mPaged - from);
+	if(from < 0 || count <= 0) return;
+
+	File pageFile(mPageFileName, File::Read);
+	pageFile.seekRead(mPagedOffsets[from]);
+	BinarySerializer serializer(&pageFile);
+	Mail m;
+	for(int i = 0; i < count && (serializer >> m); ++i)
+		mails.push_back(m);
+}
+
+bool Board::listing(int next, Array<Mail> &result) const
+{
+	next = std::max(next, 0);
+
+	// Read back a bounded range of paged mails, the client continues from where it stopped
+	readPaged(next, MaxPagedListing, result);
+	if(next + int(result.size()) < mPaged)
+		return false;
+
+	// Copy since listed mails may be paged out once the lock is released
+	for(int i = std::max(next - mPaged, 0); i < int(mListing.size()); ++i)
+		result.push_back(*mListing[i]);
+
+	return true;
+}
+
 bool Board::anounce(const Network::Locator &locator, List<BinaryString> &targets)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
@@ -242,61 +437,139 @@ bool Board::anounce(const Network::Locator &locator, List<BinaryString> &targets
 
 bool Board::incoming(const Network::Locator &locator, const BinaryString &target)
 {
-	// Fetch resource metadata
-	if(!fetch(locator, target, false))	// don't fetch content
+	std::unique_lock<std::mutex> lock(mMutex);
+	if(mProcessedDigests.contains(target) || mSyncDigests.contains(target))
 		return false;
 
-	// Check resource
-	Resource resource(target, true);	// local only
-	if(resource.type() != "mail")
-		return false;
+	sync(locator, target);
+	return true;
+}
 
-	// Now fetch resource content
-	if(!fetch(locator, target, true))	// fetch content
-		return false;
+void Board::sync(const Network::Locator &locator, const BinaryString &target)
+{
+	mSyncQueue.push_back(std::make_pair(locator, target));
+	mSyncDigests.insert(target);
 
-	try {
-		std::unique_lock<std::mutex> lock(mMutex);
+	while(mSyncTasks < MaxSyncTasks && mSyncTasks < mSyncQueue.size())
+	{
+		++mSyncTasks;
+		schedule([this]()
+		{
+			syncTask();
+		});
+	}
+}
 
-		if(mProcessedDigests.contains(target))
-			return false;
+void Board::syncTask(void)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(!mSyncQueue.empty())
+	{
+		Network::Locator locator = mSyncQueue.front().first;
+		BinaryString target = mSyncQueue.front().second;
+		mSyncQueue.pop_front();
+
+		// Fetch and decode without holding the lock
+		lock.unlock();
+		List<Mail> mails;
+		List<BinaryString> previous;
+		bool snapshot = false;
+		bool success = false;
+		try {
+			success = decode(target, mails, previous, snapshot);
+			if(success) Mail::Verify(mails);
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("Board::sync", "Fetching failed for " + target.toString() + ": " + e.what());
+		}
+		lock.lock();
+
+		mSyncDigests.erase(target);
+		if(!success || mProcessedDigests.contains(target))
+			continue;
 
 		if(!mPreviousDigests.contains(target))
 			mDigests.insert(target);	// top-level
 
-		// Fetch previous
-		List<BinaryString> previous;
-		if(resource.getPreviousDigests(previous))
-			for(const BinaryString &d : previous)
-			{
-				mDigests.erase(d);
-				mPreviousDigests.insert(d);
-				fetch(locator, d, true);
-			}
-
-		// Process
-		List<Mail> mails;
-		Resource::Reader reader(&resource, mSecret);
-		BinarySerializer serializer(&reader);
-		Mail m;
-		while(serializer >> m)
+		for(const BinaryString &d : previous)
 		{
-			if(m.empty()) continue;
-			mails.push_back(std::move(m));
+			mDigests.erase(d);
+			mPreviousDigests.insert(d);
+			if(snapshot) mProcessedDigests.insert(d);	// superseded by an authenticated snapshot
+			else if(!mProcessedDigests.contains(d) && !mSyncDigests.contains(d))
+				sync(locator, d);
 		}
 
+		// Merge the whole resource at once
+		for(const Mail &m : mails)
+			appendMail(m);
+
 		mProcessedDigests.insert(target);
+		if(snapshot) mChained = 0;
+		else ++mChained;
+		page();
+	}
 
-		lock.unlock();
+	--mSyncTasks;
+	mSyncCondition.notify_all();
+}
 
-		// Finally, append
-		for(const Mail &m : mails)
-			appendMail(m);
+bool Board::decode(const BinaryString &target, List<Mail> &mails, List<BinaryString> &previous, bool &snapshot) const
+{
+	// Fetch resource metadata
+	Resource resource(target);
+	if(resource.type() != "mail")
+		return false;
+
+	snapshot = (!mSecret.empty() && resource.name() == mName + SnapshotSuffix);
+
+	resource.getPreviousDigests(previous);
+
+	if(snapshot)
+	{
+		// A snapshot holds nothing new if all superseded digests are already processed
+		std::unique_lock<std::mutex> lock(mMutex);
+		bool processed = true;
+		for(const BinaryString &d : previous)
+			if(!mProcessedDigests.contains(d))
+			{
+				processed = false;
+				break;
+			}
+
+		if(processed) return true;
 	}
-	catch(const Exception &e)
+
+	// Fetch resource content while reading
+	Resource::Reader reader(&resource, mSecret);
+	BinarySerializer serializer(&reader);
+
+	BinaryString mac;
+	if(snapshot && !(serializer >> mac))
+		return false;
+
+	Sha3_256 hash;
+	hash.init();
+
+	Mail m;
+	while(serializer >> m)
 	{
-		LogWarn("Board::incoming", e.what());
-		return true;
+		if(m.empty()) continue;
+		if(snapshot) hash.process(m.digest());
+		mails.push_back(std::move(m));
+	}
+
+	if(snapshot)
+	{
+		BinaryString mailsDigest;
+		hash.finalize(mailsDigest);
+		if(mac != snapshotMac(previous, mailsDigest))
+		{
+			// Superseded digests are synchronized as for any other resource
+			LogWarn("Board::decode", "Unauthenticated snapshot " + target.toString());
+			snapshot = false;
+		}
 	}
 
 	return true;
@@ -306,6 +579,9 @@ bool Board::incoming(const Network::Locator &locator, const Mail &mail)
 {
 	List<Mail> tmp;
 	tmp.push_back(mail);
+	Mail::Verify(tmp);
+	if(tmp.empty()) return false;
+
 	mHasNew = true;
 	add(tmp);
 	return true;
@@ -381,10 +657,10 @@ void Board::http(const String &prefix, Http::Request &request)
 						throw 404;
 					}
 
-					auto it = mMails.find(digest);
-					if(it != mMails.end())
+					Mail mail;
+					if(getMail(digest, mail))
 					{
-						user->board()->post(it->second);
+						user->board()->post(mail);
 
 						Http::Response response(request, 200);
 						response.send();
@@ -407,8 +683,8 @@ void Board::http(const String &prefix, Http::Request &request)
 						throw 404;
 					}
 
-					auto it = mMails.find(digest);
-					if(it == mMails.end())
+					Mail mail;
+					if(!getMail(digest, mail))
 						throw 404;
 
 					Http::Response response(request, 200);
@@ -417,7 +693,7 @@ void Board::http(const String &prefix, Http::Request &request)
 
 					JsonSerializer json(response.stream);
 					json.setOptionalOutputMode(true);
-					json << it->second;
+					json << mail;
 					return;
 				}
 
@@ -429,19 +705,70 @@ void Board::http(const String &prefix, Http::Request &request)
 				if(request.get.contains("timeout"))
 					timeout = seconds(request.get["timeout"].toDouble());
 
-				decltype(mListing) tmp;
+				// Server-Sent Events
+				String accept;
+				request.headers.get("Accept", accept);
+				if(accept.contains("text/event-stream"))
 				{
-					std::unique_lock<std::mutex> lock(mMutex);
+					String lastId;
+					if(request.headers.get("Last-Event-ID", lastId))
+					{
+						lastId.extract(next);
+						++next;
+					}
 
-					if(next >= int(mListing.size()))
+					if(!request.isResumed())
 					{
-						mCondition.wait_for(lock, std::chrono::duration<double>(timeout), [this, next]() {
-							return next < int(mListing.size());
-						});
+						Http::Response response(request, 200);
+						response.headers["Content-Type"] = "text/event-stream";
+						response.headers["Cache-Control"] = "no-cache";
+						response.send();
+					}
+
+					Array<Mail> tmp;
+					{
+						std::unique_lock<std::mutex> lock(mMutex);
+
+						bool complete = listing(next, tmp);
+
+						mUnread = 0;
+						mHasNew = false;
+
+						// Keep the stream open until timeout, events are sent when resumed
+						// If the listing is truncated, close it so the client reconnects for the rest
+						if(complete) request.park(mWaiter, timeout);
 					}
 
-					for(int i = next; i < int(mListing.size()); ++i)
-						tmp.push_back(mListing[i]);
+					for(const Mail &mail : tmp)
+					{
+						String data;
+						JsonSerializer json(&data);
+						json.setOptionalOutputMode(true);
+						json << mail;
+
+						List<String> lines;
+						data.remove('\r');
+						data.explode(lines, '\n');
+
+						*request.stream << "id: " << next++ << "\n";
+						for(const String &line : lines)
+							*request.stream << "data: " << line << "\n";
+						*request.stream << "\n";
+					}
+
+					request.headers["Last-Event-ID"] = String::number(next - 1);
+					return;
+				}
+
+				Array<Mail> tmp;
+				{
+					std::unique_lock<std::mutex> lock(mMutex);
+
+					// Park the request until new mails arrive or timeout
+					if(next >= mPaged + int(mListing.size()) && request.park(mWaiter, timeout))
+						return;
+
+					listing(next, tmp);
 
 					mUnread = 0;
 					mHasNew = false;
@@ -39,6 +39,11 @@ namespace tpn
 class Board : public Network::Publisher, public Network::Subscriber, public HttpInterfaceable
 {
 public:
+	static const unsigned MaxSyncTasks;
+	static const unsigned CompactionThreshold;	// chained resources before publishing a snapshot, secret boards only
+	static const unsigned MaxMails;			// listed mails kept in memory, older ones are paged out
+	static const unsigned MaxPagedListing;	// paged mails read back per listing request
+
 	Board(const String &name, const String &secret = "", const String &displayName = "");
 	~Board(void);
 
@@ -64,6 +69,22 @@ public:
 private:
 	void add(const List<Mail> &mails);	// locks
 	void appendMail(const Mail &mail);	// mutex must be locked first
+	bool getMail(const BinaryString &digest, Mail &mail) const;	// locks
+
+	// Snapshots contain the full board state and supersede previous digests,
+	// they are authenticated with a MAC under the secret so only secret boards are compacted
+	void compact(void);	// mutex must be locked first
+	BinaryString snapshotMac(const List<BinaryString> &previous, const BinaryString &mailsDigest) const;
+	void page(void);	// mutex must be locked first
+	void readPaged(int from, int count, Array<Mail> &mails) const;	// mutex must be locked first
+	bool listing(int next, Array<Mail> &result) const;	// mutex must be locked first, false if truncated
+
+	// History is synchronized by fetching previous digests with bounded parallelism
+	void sync(const Network::Locator &locator, const BinaryString &target);	// mutex must be locked first
+	void syncTask(void);
+	bool decode(const BinaryString &target, List<Mail> &mails, List<BinaryString> &previous, bool &snapshot) const;	// locks
+
+	static const String SnapshotSuffix;
 
 	String mName;
 	String mDisplayName;
@@ -74,11 +95,23 @@ private:
 	Map<BinaryString, List<const Mail*> > mOrphans;
 	Array<const Mail*> mListing;
 
+	String mPageFileName;
+	Map<BinaryString, int64_t> mPagedDigests;	// offsets in page file
+	Array<int64_t> mPagedOffsets;	// offsets in listing order
+	int64_t mPageSize;
+	int mPaged;		// listed mails paged out, mListing starts at this position
+	unsigned mChained;	// resources chained since last snapshot
+
 	Set<sptr<Board> > mSubBoards;
 	Set<Board*> mBoards;
 
+	List<std::pair<Network::Locator, BinaryString> > mSyncQueue;
+	Set<BinaryString> mSyncDigests;	// queued or being fetched
+	unsigned mSyncTasks;
+	std::condition_variable mSyncCondition;
+
 	mutable std::mutex mMutex;
-	mutable std::condition_variable mCondition;
+	Http::Waiter mWaiter;
 	mutable bool mHasNew;
 	mutable unsigned mUnread;
 };
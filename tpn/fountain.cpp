@@ -23,6 +23,7 @@
 
 #include "pla/random.hpp"
 #include "pla/crypto.hpp"
+#include "pla/binaryserializer.hpp"
 
 namespace tpn
 {
@@ -813,4 +814,77 @@ int64_t Fountain::Sink::hash(BinaryString &digest) const
 	return total;
 }
 
+void Fountain::Sink::save(Stream &stream) const
+{
+	BinarySerializer s(&stream);
+	s << uint32_t(mNextDiscovered);
+	s << uint32_t(mNextSeen);
+	s << uint32_t(mNextDecoded);
+	s << uint32_t(mNextRead);
+	s << uint32_t(mDropped);
+	s << uint8_t(mFinished ? 1 : 0);
+	s << uint64_t(mAlreadyRead);
+	s << uint32_t(mCombinations.size());
+
+	// Combinations are reduced, so coefficients are written explicitly
+	for(auto it = mCombinations.begin(); it != mCombinations.end(); ++it)
+	{
+		const Combination &c = it->second;
+		s << uint32_t(it->first);
+		s << uint32_t(c.firstComponent());
+		s << uint32_t(c.componentsCount());
+		for(unsigned i = 0; i < c.componentsCount(); ++i)
+			s << c.coeff(c.firstComponent() + i);
+		s << BinaryString(c.data(), c.codedSize());
+	}
+}
+
+bool Fountain::Sink::load(Stream &stream)
+{
+	clear();
+
+	BinarySerializer s(&stream);
+	uint32_t nextDiscovered, nextSeen, nextDecoded, nextRead, dropped, count;
+	uint8_t finished;
+	uint64_t alreadyRead;
+	if(!(s >> nextDiscovered)) return false;
+	AssertIO(s >> nextSeen);
+	AssertIO(s >> nextDecoded);
+	AssertIO(s >> nextRead);
+	AssertIO(s >> dropped);
+	AssertIO(s >> finished);
+	AssertIO(s >> alreadyRead);
+	AssertIO(s >> count);
+
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t pivot, first, components;
+		AssertIO(s >> pivot);
+		AssertIO(s >> first);
+		AssertIO(s >> components);
+
+		Combination c;
+		for(uint32_t j = 0; j < components; ++j)
+		{
+			uint8_t coeff;
+			AssertIO(s >> coeff);
+			c.addComponent(first + j, coeff);
+		}
+
+		BinaryString data;
+		AssertIO(s >> data);
+		c.setCodedData(data);
+		mCombinations.insert(pivot, c);
+	}
+
+	mNextDiscovered = nextDiscovered;
+	mNextSeen = nextSeen;
+	mNextDecoded = nextDecoded;
+	mNextRead = nextRead;
+	mDropped = dropped;
+	mFinished = (finished != 0);
+	mAlreadyRead = size_t(alreadyRead);
+	return true;
+}
+
 }
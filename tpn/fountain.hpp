@@ -176,6 +176,9 @@ public:
 		int64_t dump(Stream &stream) const;		// Read all decoded data in buffer
 		int64_t hash(BinaryString &digest) const;	// Hash all decoded data in buffer
 
+		void save(Stream &stream) const;	// Write decoding state
+		bool load(Stream &stream);		// Restore decoding state
+
 	private:
 		Map<unsigned, Combination> mCombinations;	// combinations sorted by pivot component
 
@@ -23,6 +23,7 @@
 #include "tpn/request.hpp"
 #include "tpn/user.hpp"
 #include "tpn/config.hpp"
+#include "tpn/interface.hpp"
 
 #include "pla/exception.hpp"
 #include "pla/mime.hpp"
@@ -65,6 +66,12 @@ void Html::header(const String &title, bool blank, const String &redirect)
 {
 	mBlank = blank;
 
+	// Content-hashed URLs can be cached by browsers without revalidation
+	auto staticUrl = [](const String &name) -> String {
+		if(Interface::Instance) return Interface::Instance->staticUrl(name);
+		return "/static/" + name;
+	};
+
 	*mStream<<"<!DOCTYPE html>\n";
 	*mStream<<"<html>\n";
 	*mStream<<"<head>\n";
@@ -73,16 +80,16 @@ void Html::header(const String &title, bool blank, const String &redirect)
 	else *mStream<<"<title>"<<title<<" - "<<APPNAME<<"</title>\n";
 	*mStream<<"<meta http-equiv=\"content-type\" content=\"text/html;charset=UTF-8\">\n";
 	*mStream<<"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1, maximum-scale=1\">\n";
-	*mStream<<"<link rel=\"stylesheet\" type=\"text/css\" href=\"/static/style.css\">\n";
+	*mStream<<"<link rel=\"stylesheet\" type=\"text/css\" href=\""<<staticUrl("style.css")<<"\">\n";
 	*mStream<<"<link rel=\"shortcut icon\" type=\"image/x-icon\" href=\"/static/favicon.ico\">\n";
 	if(!redirect.empty()) *mStream<<"<meta http-equiv=\"refresh\" content=\"3;URL='"+redirect+"'\">\n";
 	*mStream<<"<noscript><meta http-equiv=\"refresh\" content=\"0;url=/static/noscript.html\"></noscript>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/jquery.min.js\"></script>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/jquery.form.min.js\"></script>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/common.js\"></script>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/contacts.js\"></script>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/directory.js\"></script>\n";
-	*mStream<<"<script type=\"text/javascript\" src=\"/static/mail.js\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("jquery.min.js")<<"\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("jquery.form.min.js")<<"\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("common.js")<<"\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("contacts.js")<<"\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("directory.js")<<"\"></script>\n";
+	*mStream<<"<script type=\"text/javascript\" src=\""<<staticUrl("mail.js")<<"\"></script>\n";
 	*mStream<<"<base target=\"_parent\">\n";
 
 	// Load specific CSS on touch devices
@@ -1408,7 +1408,7 @@ void Indexer::http(const String &prefix, Http::Request &request)
 				response.send();
 
 				File file(path, File::Read);
-				response.stream->write(file);
+				response.stream->writeFile(file, file.size());
 			}
 			else throw 404;
 		}
@@ -30,12 +30,19 @@
 #include "pla/directory.hpp"
 #include "pla/jsonserializer.hpp"
 #include "pla/mime.hpp"
+#include "pla/crypto.hpp"
+#include "pla/budget.hpp"
+#include "pla/securetransport.hpp"
+
+#include <zlib.h>
 
 namespace tpn
 {
 
 Interface *Interface::Instance = NULL;
 
+const uint64_t Interface::MaxStaticFileSize = 1024*1024;	// 1 MiB
+
 Interface::Interface(int port) :
 		Http::Server(port)
 {
@@ -43,6 +50,7 @@ Interface::Interface(int port) :
 	add("/static", this);
 	add("/file", this);
 	add("/mail", this);
+	add("/stats", this);
 
 	const String badPasswordsFile = Config::Get("static_dir") + "/bad_passwords.txt";
 	if(File::Exist(badPasswordsFile))
@@ -51,6 +59,8 @@ Interface::Interface(int port) :
 		file.read(mBadPasswordsString);
 		file.close();
 	}
+
+	loadStaticFiles();
 }
 
 Interface::~Interface(void)
@@ -306,6 +316,9 @@ void Interface::http(const String &prefix, Http::Request &request)
 				|| name == "." || name == "..")
 				throw 404;
 
+			if(respondWithStaticFile(request, name))
+				return;
+
 			String path = Config::Get("static_dir") + Directory::Separator + name;
 			if(File::Exist(path))
 			{
@@ -423,7 +436,7 @@ void Interface::http(const String &prefix, Http::Request &request)
 						// Launch transfer
 						Resource::Reader reader(&resource);
 						if(hasRange) reader.seekRead(rangeBegin);
-						int64_t size = reader.readBinary(*response.stream, rangeSize);	// let's go !
+						int64_t size = reader.transfer(*response.stream, rangeSize);	// let's go !
 						if(size != rangeSize)
 							throw Exception("Range size is " + String::number(rangeSize) + ", but sent size is " + String::number(size));
 					}
@@ -440,6 +453,24 @@ void Interface::http(const String &prefix, Http::Request &request)
 				return;
 			}
 		}
+		else if(prefix == "/stats")
+		{
+			if(request.url != "/") throw 404;
+			if(!request.remoteAddress.isLocal()) throw 403;	// exposes per-peer usage
+
+			Http::Response response(request, 200);
+			response.headers["Content-Type"] = "application/json";
+			response.send();
+
+			JsonSerializer json(response.stream);
+			json << Object()
+				.insert("overlay", Network::Instance->overlay()->statistics())
+				.insert("memory", Budget::Statistics())
+				.insert("handshakes", Object()
+					.insert("full", SecureTransport::FullHandshakes())
+					.insert("resumed", SecureTransport::ResumedHandshakes()));
+			return;
+		}
 		else if(prefix == "/mail")
 		{
 			LogWarn("Interface::process", "Creating board: " + request.url);
@@ -465,6 +496,125 @@ void Interface::http(const String &prefix, Http::Request &request)
 	throw 404;
 }
 
+String Interface::staticUrl(const String &name) const
+{
+	auto it = mStaticFiles.find(name);
+	if(it == mStaticFiles.end()) return "/static/" + name;
+	return "/static/" + name + "?v=" + it->second.etag.substr(1, 16);
+}
+
+bool Interface::Gzip(const BinaryString &input, BinaryString &output)
+{
+	z_stream zs;
+	std::memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)	// +16 for gzip header
+		return false;
+
+	output.resize(deflateBound(&zs, uLong(input.size())));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+	zs.avail_in = uInt(input.size());
+	zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+	zs.avail_out = uInt(output.size());
+
+	int ret = deflate(&zs, Z_FINISH);
+	output.resize(zs.total_out);
+	deflateEnd(&zs);
+	return (ret == Z_STREAM_END);
+}
+
+void Interface::loadStaticFiles(void)
+{
+	String path = Config::Get("static_dir");
+	if(!Directory::Exist(path)) return;
+
+	Directory dir(path);
+	while(dir.nextFile())
+	{
+		if(dir.fileIsDirectory() || dir.fileSize() > MaxStaticFileSize)
+			continue;
+
+		try {
+			StaticFile file;
+			file.type = Mime::GetType(dir.fileName());
+			file.time = dir.fileTime();
+
+			File input(dir.filePath(), File::Read);
+			input.readBinary(file.content);
+			input.close();
+
+			BinaryString digest;
+			Sha3_256().compute(file.content.data(), file.content.size(), digest);
+			file.etag = "\"" + digest.toString().substr(0, 32) + "\"";
+
+			// Compress text files only, images are already compressed
+			if(file.type.contains("text") || file.type.contains("javascript") || file.type.contains("json")
+				|| file.type.contains("xml") || file.type.contains("icon"))
+			{
+				if(!Gzip(file.content, file.compressed) || file.compressed.size() >= file.content.size()*9/10)
+					file.compressed.clear();
+			}
+
+			mStaticFiles.insert(dir.fileName(), file);
+		}
+		catch(const Exception &e)
+		{
+			LogWarn("Interface::loadStaticFiles", e.what());
+		}
+	}
+
+	LogDebug("Interface::loadStaticFiles", "Loaded " + String::number(int(mStaticFiles.size())) + " static files");
+}
+
+bool Interface::respondWithStaticFile(Http::Request &request, const String &name)
+{
+	auto it = mStaticFiles.find(name);
+	if(it == mStaticFiles.end()) return false;
+	if(request.headers.contains("Range")) return false;	// served from disk
+	if(request.method != "GET" && request.method != "HEAD") throw 405;
+
+	const StaticFile &file = it->second;
+
+	String acceptEncoding;
+	request.headers.get("Accept-Encoding", acceptEncoding);
+	bool gzip = (!file.compressed.empty() && acceptEncoding.contains("gzip"));
+
+	// Each encoding is a distinct representation for strong ETags
+	String etag = file.etag;
+	if(gzip) etag.insert(etag.size()-1, "-gzip");
+
+	// Versioned URLs never change, others must be revalidated
+	String cacheControl = (request.get.contains("v") ? "public, max-age=31536000, immutable" : "no-cache");
+
+	String ifNoneMatch;
+	if(request.headers.get("If-None-Match", ifNoneMatch)
+		&& (ifNoneMatch.contains(etag) || ifNoneMatch.trimmed() == "*"))
+	{
+		Http::Response response(request, 304);
+		response.headers["ETag"] = etag;
+		response.headers["Cache-Control"] = cacheControl;
+		response.headers["Vary"] = "Accept-Encoding";
+		response.send();
+		return true;
+	}
+
+	const BinaryString &content = (gzip ? file.compressed : file.content);
+
+	Http::Response response(request, 200);
+	response.headers["Content-Type"] = file.type;
+	response.headers["Content-Length"] << content.size();
+	response.headers["Last-Modified"] = file.time.toHttpDate();
+	response.headers["ETag"] = etag;
+	response.headers["Cache-Control"] = cacheControl;
+	response.headers["Vary"] = "Accept-Encoding";
+	if(gzip) response.headers["Content-Encoding"] = "gzip";
+	response.send();
+
+	if(request.method != "HEAD")
+		response.stream->writeData(content.data(), content.size());
+
+	return true;
+}
+
 void Interface::process(Http::Request &request)
 {
 	//LogDebug("Interface", request.method + " " + request.fullUrl);
@@ -485,8 +635,17 @@ void Interface::process(Http::Request &request)
 		if(list.size() >= 2)
 			name = *(++list.begin());
 
+		// Check the session token first, it is much cheaper than password derivation
+		String token;
+		if(request.cookies.get("auth_"+name, token))
+		{
+			sptr<User> tmp = User::Get(name);
+			if(tmp && tmp->checkToken(token, "auth"))
+				user = tmp;
+		}
+
 		String auth;
-		if(request.headers.get("Authorization", auth))
+		if(!user && request.headers.get("Authorization", auth))
 		{
 			String tmp = auth.cut(' ');
 			auth.trim();
@@ -499,13 +658,6 @@ void Interface::process(Http::Request &request)
 			if(authName == name)
 				user = User::Authenticate(authName, authPassword);
 		}
-		else {
-			String token;
-			request.cookies.get("auth_"+name, token);
-			sptr<User> tmp = User::Get(name);
-			if(tmp && tmp->checkToken(token, "auth"))
-				user = tmp;
-		}
 
 		if(!user)
 		{
@@ -47,6 +47,7 @@ class Interface : public Http::Server, public HttpInterfaceable
 {
 public:
 	static Interface *Instance;
+	static const uint64_t MaxStaticFileSize;
 
 	Interface(int port);
 	~Interface(void);
@@ -55,9 +56,25 @@ public:
 	void remove(const String &prefix, HttpInterfaceable *interfaceable = NULL);
 	void http(const String &prefix, Http::Request &request);
 
+	String staticUrl(const String &name) const;	// content-hashed URL of a static file
+
 private:
+	// Static file preloaded in memory
+	struct StaticFile
+	{
+		BinaryString content;
+		BinaryString compressed;	// gzip, empty if not worth it
+		String type;
+		String etag;
+		Time time;
+	};
+
+	static bool Gzip(const BinaryString &input, BinaryString &output);
+
 	void process(Http::Request &request);
 	void generate(Stream &out, int code, const String &message);
+	void loadStaticFiles(void);
+	bool respondWithStaticFile(Http::Request &request, const String &name);
 
 	Map<String, HttpInterfaceable*> mPrefixes;
 	Set<HttpInterfaceable*> mBusy;
@@ -65,6 +82,7 @@ private:
 	std::condition_variable mCondition;
 
 	String mBadPasswordsString;
+	Map<String, StaticFile> mStaticFiles;	// read-only after construction
 };
 
 }
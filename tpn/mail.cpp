@@ -28,10 +28,82 @@
 #include "pla/binaryserializer.hpp"
 #include "pla/object.hpp"
 #include "pla/crypto.hpp"
+#include "pla/threadpool.hpp"
 
 namespace tpn
 {
 
+const unsigned Mail::VerifyThreads = 4;
+const size_t Mail::MaxVerified = 65536;
+
+Set<BinaryString> Mail::Verified;
+List<BinaryString> Mail::VerifiedOrder;
+std::mutex Mail::VerifiedMutex;
+
+void Mail::Verify(List<Mail> &mails)
+{
+	static ThreadPool pool(VerifyThreads);
+
+	std::vector<std::pair<Mail*, std::future<Verification> > > pending;
+	for(Mail &m : mails)
+	{
+		if(!m.isSigned())
+			continue;
+
+		{
+			std::unique_lock<std::mutex> lock(VerifiedMutex);
+			if(Verified.contains(m.digest() + m.mSignature))
+				continue;
+		}
+
+		Mail *ptr = &m;
+		pending.emplace_back(ptr, pool.enqueue([ptr]()
+		{
+			return ptr->verify();
+		}));
+	}
+
+	Set<BinaryString> invalid;
+	for(auto &p : pending)
+	{
+		switch(p.second.get())
+		{
+		case Valid:
+		{
+			std::unique_lock<std::mutex> lock(VerifiedMutex);
+			BinaryString key = p.first->digest() + p.first->mSignature;
+			if(Verified.contains(key))
+				break;
+
+			Verified.insert(key);
+			VerifiedOrder.push_back(key);
+			while(VerifiedOrder.size() > MaxVerified)
+			{
+				Verified.erase(VerifiedOrder.front());
+				VerifiedOrder.pop_front();
+			}
+			break;
+		}
+
+		case Invalid:
+			LogWarn("Mail::Verify", "Invalid signature for mail " + p.first->digest().toString());
+			invalid.insert(p.first->digest());
+			break;
+
+		default:
+			break;	// accepted, but checked again next time
+		}
+	}
+
+	if(!invalid.empty())
+	{
+		mails.remove_if([&invalid](const Mail &m)
+		{
+			return invalid.contains(m.digest());
+		});
+	}
+}
+
 Mail::Mail(const String &content) :
 	mTime(time_t(Time::Now()))
 {
@@ -123,7 +195,21 @@ bool Mail::isSigned(void) const
 	return !mSignature.empty();
 }
 
+Mail::Verification Mail::verify(void) const
+{
+	Rsa::PublicKey pubKey;
+	if(!Network::Instance->getPublicKey(mIdentifier, pubKey))
+		return Unknown;
+
+	return check(pubKey) ? Valid : Invalid;
+}
+
 void Mail::serialize(Serializer &s) const
+{
+	serializeObject(s, true);
+}
+
+void Mail::serializeObject(Serializer &s, bool signature) const
 {
 	Object object;
 	object.insert("content", mContent);
@@ -133,9 +219,9 @@ void Mail::serialize(Serializer &s) const
 	if(!mIdentifier.empty()) object.insert("identifier", mIdentifier);
 	if(!mAttachments.empty()) object.insert("attachments", mAttachments);
 	if(!mParent.empty()) object.insert("parent", mParent);
-	if(!mSignature.empty()) object.insert("signature", mSignature);
+	if(signature && !mSignature.empty()) object.insert("signature", mSignature);
 
-	if(s.optionalOutputMode())
+	if(signature && s.optionalOutputMode())
 	{
 		digest();	// so mDigest is computed
 		object.insert("digest", mDigest);
@@ -171,18 +257,11 @@ bool Mail::deserialize(Serializer &s)
 
 BinaryString Mail::computeDigest(void) const
 {
-	BinaryString signature = mSignature;
-	mSignature.clear();
-
+	// Serialize without signature, instead of clearing and restoring it on a shared object
 	BinaryString tmp;
 	BinarySerializer serializer(&tmp);
-	serializer << *this;
-
-	BinaryString digest;
-	Sha256().compute(tmp, digest),
-
-	mSignature = signature;
-	return digest;
+	serializeObject(serializer, false);
+	return Sha256().compute(tmp);
 }
 
 bool Mail::isInlineSerializable(void) const
@@ -28,6 +28,8 @@
 #include "pla/binarystring.hpp"
 #include "pla/array.hpp"
 #include "pla/array.hpp"
+#include "pla/list.hpp"
+#include "pla/set.hpp"
 #include "pla/time.hpp"
 #include "pla/crypto.hpp"
 
@@ -37,6 +39,13 @@ namespace tpn
 class Mail : public Serializable
 {
 public:
+	static const unsigned VerifyThreads;
+	static const size_t MaxVerified;
+
+	// Check signatures in parallel and remove mails with an invalid one,
+	// valid signatures are remembered locally so each mail is checked once
+	static void Verify(List<Mail> &mails);
+
 	Mail(const String &content = "");
 	virtual ~Mail(void);
 
@@ -63,6 +72,20 @@ public:
 	virtual bool isInlineSerializable(void) const;
 
 private:
+	// Local only, keyed by digest and signature
+	static Set<BinaryString> Verified;
+	static List<BinaryString> VerifiedOrder;	// oldest first
+	static std::mutex VerifiedMutex;
+
+	enum Verification
+	{
+		Valid,
+		Invalid,
+		Unknown		// author key not available
+	};
+
+	Verification verify(void) const;
+	void serializeObject(Serializer &s, bool signature) const;
 	BinaryString computeDigest(void) const;
 
 	Time mTime;
@@ -37,8 +37,10 @@
 #include "pla/scheduler.hpp"
 #include "pla/random.hpp"
 #include "pla/securetransport.hpp"
+#include "pla/crypto.hpp"
 #include "pla/proxy.hpp"
 #include "pla/file.hpp"
+#include "pla/budget.hpp"
 
 #include <signal.h>
 
@@ -336,6 +338,7 @@ int main(int argc, char** argv)
 	// Cleanup
 	SecureTransport::Cleanup();
 	Fountain::Cleanup();
+	Argon2::ClearCache();
 
 #ifdef PTW32_STATIC_LIB
 	pthread_win32_process_detach_np();
@@ -377,6 +380,7 @@ int run(String &commandLine, StringMap &args)
 	Config::Default("min_connections", "8");
 	Config::Default("max_connections", "256");
 	Config::Default("store_max_age", "21600");	// 6h
+	Config::Default("store_spill_sinks", "true");
 	Config::Default("user_global_shares", "true");
 	Config::Default("force_http_tunnel", "false");
 
@@ -390,11 +394,13 @@ int run(String &commandLine, StringMap &args)
 #ifdef ANDROID
 	Config::Default("cache_max_size", "200");		// MiB
 	Config::Default("cache_max_file_size", "20");	// MiB
+	Config::Default("memory_budget", "64");		// MiB
 	if(!SharedDirectory.empty()) Config::Put("shared_dir", SharedDirectory);
 	if(!CacheDirectory.empty())  Config::Put("cache_dir",  CacheDirectory);
 #else
 	Config::Default("cache_max_size", "10000");		// MiB
 	Config::Default("cache_max_file_size", "1000");	// MiB
+	Config::Default("memory_budget", "512");		// MiB
 #endif
 
 #if defined(WINDOWS) || defined(MACOSX)
@@ -658,6 +664,9 @@ int run(String &commandLine, StringMap &args)
 	int ifport;
 	sifport >> ifport;
 
+	// Limit memory held on behalf of remote peers
+	Budget::SetLimit(uint64_t(Config::Get("memory_budget").toInt())*1024*1024);
+
 	// Init Cache and Store
 	Cache::Instance = new Cache;
 	Store::Instance = new Store;
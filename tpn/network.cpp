@@ -28,6 +28,7 @@
 
 #include "pla/binaryserializer.hpp"
 #include "pla/jsonserializer.hpp"
+#include "pla/bytearray.hpp"
 #include "pla/object.hpp"
 #include "pla/securetransport.hpp"
 #include "pla/crypto.hpp"
@@ -44,6 +45,14 @@ const unsigned Network::DefaultRedundantCount = 32;
 const double   Network::DefaultRedundancy = 1.20;
 const double   Network::DefaultPacketRate = 1000.;	// Packets/second
 const duration Network::CallPeriod = seconds(1.);
+const uint8_t  Network::RecordVersion = 1;
+const unsigned Network::StalledPeriods = 3;
+const unsigned Network::MaxStalledBackoff = 64;	// periods
+
+const duration Network::Tunneler::LegacyRetryPeriod = seconds(600.);	// 10 min
+const uint64_t Network::Tunneler::MaxPeerQueuedBytes = 4*1024*1024;	// 4 MiB
+Budget::Account Network::Tunneler::QueueAccount("tunnel", 0, Network::Tunneler::MaxPeerQueuedBytes);
+Budget::Account Network::Handler::SourceAccount("flow");
 
 Network *Network::Instance = NULL;
 const Network::Link Network::Link::Null;
@@ -92,6 +101,7 @@ void Network::registerCaller(const BinaryString &target, Caller *caller)
 		std::unique_lock<std::mutex> lock(mCallersMutex);
 		first = !mCallers.contains(target);
 		mCallers[target].insert(caller);
+		if(first) Store::Instance->setCalled(target, true);
 	}
 
 	if(first) directCall(target, Store::Instance->missing(target));
@@ -112,6 +122,7 @@ void Network::unregisterCaller(const BinaryString &target, Caller *caller)
 			if(it->second.empty())
 			{
 				mCallers.erase(it);
+				Store::Instance->setCalled(target, false);
 				last = true;
 			}
 		}
@@ -122,8 +133,14 @@ void Network::unregisterCaller(const BinaryString &target, Caller *caller)
 
 void Network::unregisterAllCallers(const BinaryString &target)
 {
-	std::unique_lock<std::mutex> lock(mCallersMutex);
-	mCallers.erase(target);
+	{
+		std::unique_lock<std::mutex> lock(mCallersMutex);
+		mCallers.erase(target);
+		Store::Instance->setCalled(target, false);
+	}
+
+	std::unique_lock<std::mutex> lock(mSwarmsMutex);
+	mSwarms.erase(target);
 }
 
 void Network::registerListener(const Identifier &local, const Identifier &remote, Listener *listener)
@@ -371,6 +388,19 @@ bool Network::getLinkFromNode(const BinaryString &node, Link &link) const
 	else return false;
 }
 
+bool Network::getPublicKey(const Identifier &identifier, Rsa::PublicKey &pubKey) const
+{
+	sptr<User> user = User::GetByIdentifier(identifier);
+	if(user)
+	{
+		pubKey = user->publicKey();
+		return true;
+	}
+
+	std::unique_lock<std::mutex> lock(mPublicKeysMutex);
+	return mPublicKeys.get(identifier, pubKey);
+}
+
 void Network::run(void)
 {
 	const duration period = CallPeriod;
@@ -464,6 +494,7 @@ void Network::run(void)
 
 			// Tunnel
 			case Overlay::Message::Tunnel:
+			case Overlay::Message::Mux:
 				{
 					mTunneler.incoming(message);
 					break;
@@ -472,6 +503,7 @@ void Network::run(void)
 		}
 
 		// Send calls
+		updateSwarms();
 		sendCalls();
 
 		// Send beacons
@@ -615,9 +647,6 @@ bool Network::outgoing(const String &type, const Serializable &content)
 
 bool Network::outgoing(const Link &link, const String &type, const Serializable &content)
 {
-	String serialized;
-	JsonSerializer(&serialized) << content;
-
 	Set<sptr<Handler> > handlers;
 	{
 		std::unique_lock<std::recursive_mutex> lock1(mHandlersMutex,  std::defer_lock);
@@ -640,7 +669,7 @@ bool Network::outgoing(const Link &link, const String &type, const Serializable
 	}
 
 	for(auto h : handlers)
-		h->write(type, serialized);
+		h->write(type, content);	// encoded according to the format negotiated on each link
 
 	LogDebug("Network::outgoing", "Sending command (type=\"" + type + "\") on " + String::number(handlers.size()) + " links");
 	return !handlers.empty();
@@ -692,10 +721,11 @@ bool Network::incoming(const Link &link, const String &type, Serializer &seriali
 	if(type == "pull")	// equivalent to call between users
 	{
 		BinaryString target;
-		unsigned tokens = 0;
-		serializer >> Object()
+		uint16_t tokens = 0;	// same type as written by directCall()
+		if(!(serializer >> Object()
 				.insert("target", target)
-				.insert("tokens", tokens);
+				.insert("tokens", tokens)))
+			return false;
 
 		if(tokens) LogDebug("Network::incoming", "Pulled " + target.toString() + " (" + String::number(tokens) + " tokens)");
 
@@ -705,8 +735,9 @@ bool Network::incoming(const Link &link, const String &type, Serializer &seriali
 	else if(type == "push")
 	{
 		BinaryString target;
-		serializer >> Object()
-				.insert("target", target);
+		if(!(serializer >> Object()
+				.insert("target", target)))
+			return false;
 
 		unsigned tokens = Store::Instance->missing(target);
 		if(tokens) directCall(target, tokens);
@@ -724,10 +755,11 @@ bool Network::incoming(const Link &link, const String &type, Serializer &seriali
 		String path;
 		Mail mail;
 		List<BinaryString> targets;
-		serializer >> Object()
+		if(!(serializer >> Object()
 				.insert("path", path)
 				.insert("message", mail)
-				.insert("targets", targets);
+				.insert("targets", targets)))
+			return false;
 
 		if(!path.empty() && path[path.size()-1] == '/')
 			path.resize(path.size()-1);
@@ -761,8 +793,9 @@ bool Network::incoming(const Link &link, const String &type, Serializer &seriali
 	else if(type == "subscribe")
 	{
 		String path;
-		serializer >> Object()
-				.insert("path", path);
+		if(!(serializer >> Object()
+				.insert("path", path)))
+			return false;
 
 		if(!path.empty() && path[path.size()-1] == '/')
 		path.resize(path.size()-1);
@@ -772,8 +805,9 @@ bool Network::incoming(const Link &link, const String &type, Serializer &seriali
 	else if(type == "invite")
 	{
 		String name;
-		serializer >> Object()
-				.insert("name", name);
+		if(!(serializer >> Object()
+				.insert("name", name)))
+			return false;
 
 		sptr<User> user = User::GetByIdentifier(link.local);
 		if(user && !name.empty()) user->invite(link.remote, name);
@@ -806,17 +840,67 @@ bool Network::directCall(const BinaryString &target, unsigned tokens)
 		}
 	}
 
+	if(!tokens)
+	{
+		std::unique_lock<std::mutex> lock(mSwarmsMutex);
+		mSwarms.erase(target);
+	}
+
 	if(links.empty()) return false;
 
 	LogDebug("Network::run", "Pulling " + target.toString() + " from " + String::number(links.size()) + " users");
 
+	// Split tokens between sources according to their delivery rates
+	Map<Link, unsigned> allocation;
+	if(tokens)
+	{
+		std::unique_lock<std::mutex> lock(mSwarmsMutex);
+		Map<Link, Source> &swarm = mSwarms[target];
+
+		double maxRate = 0.;
+		for(const Link &link : links)
+			maxRate = std::max(maxRate, swarm[link].rate);
+
+		// Slow or unknown sources keep a small share so they are probed
+		const double probe = std::max(1., maxRate*0.1);
+
+		Map<Link, double> weights;
+		double total = 0.;
+		for(const Link &link : links)
+		{
+			// Sources already busy with other targets get a lower share,
+			// so different blocks tend to be fetched from different sources
+			unsigned load = 0;
+			for(const auto &p : mSwarms)
+			{
+				if(p.first == target) continue;
+				auto it = p.second.find(link);
+				if(it != p.second.end() && it->second.requested) ++load;
+			}
+
+			double weight = (swarm[link].rate + probe)/(1. + load);
+			weights.insert(link, weight);
+			total+= weight;
+		}
+
+		for(const Link &link : links)
+		{
+			unsigned t = unsigned(std::ceil(double(tokens)*weights[link]/total));
+			t = std::max(t, unsigned(1));
+			swarm[link].requested = t;
+			allocation.insert(link, t);
+		}
+	}
+
 	// Immediately send pull
-	if(tokens) tokens = (tokens + (links.size()-1))/links.size();
 	for(auto link : links)
 	{
+		unsigned t = 0;
+		allocation.get(link, t);
+
 		send(link, "pull", Object()
 			.insert("target", target)
-			.insert("tokens", uint16_t(tokens)));
+			.insert("tokens", uint16_t(t)));
 	}
 
 	return true;
@@ -851,6 +935,67 @@ bool Network::fallbackCall(const BinaryString &target, unsigned tokens)
 	return success;
 }
 
+void Network::delivered(const Link &link, const BinaryString &target)
+{
+	std::unique_lock<std::mutex> lock(mSwarmsMutex);
+
+	auto it = mSwarms.find(target);
+	if(it != mSwarms.end())
+		++it->second[link].received;
+}
+
+void Network::updateSwarms(void)
+{
+	const double period = seconds(CallPeriod).count();
+
+	// Update delivery rates and find targets with stalled sources
+	List<BinaryString> stalled;
+	{
+		std::unique_lock<std::mutex> lock(mSwarmsMutex);
+
+		for(auto &p : mSwarms)
+		{
+			bool reallocate = false;
+			for(auto &q : p.second)
+			{
+				Source &source = q.second;
+				source.rate = 0.5*source.rate + 0.5*double(source.received)/period;
+
+				if(source.received)
+				{
+					source.stalled = 0;
+					source.retries = 0;
+					source.backoff = 0;
+				}
+				else if(source.requested)
+				{
+					// Reallocate after several empty periods, then back off exponentially
+					++source.stalled;
+					if(source.backoff) --source.backoff;
+					else if(source.stalled >= StalledPeriods)
+					{
+						reallocate = true;
+						source.backoff = std::min(1u << std::min(source.retries, 6u), MaxStalledBackoff);
+						++source.retries;
+					}
+				}
+
+				source.requested-= std::min(source.requested, source.received);
+				source.received = 0;
+			}
+
+			if(reallocate) stalled.push_back(p.first);
+		}
+	}
+
+	// Pull again, tokens of stalled sources are moved to faster ones
+	for(const BinaryString &target : stalled)
+	{
+		unsigned tokens = Store::Instance->missing(target);
+		if(tokens) directCall(target, tokens);
+	}
+}
+
 bool Network::matchPublishers(const String &path, const Link &link, Subscriber *subscriber)
 {
 	if(path.empty() || path[0] != '/') return false;
@@ -1089,6 +1234,12 @@ bool Network::onRecv(const Link &link, const String &type, Serializer &serialize
 
 bool Network::onAuth(const Link &link, const Rsa::PublicKey &pubKey) const
 {
+	if(pubKey.fingerprint<Sha3_256>() == link.remote)
+	{
+		std::unique_lock<std::mutex> lock(mPublicKeysMutex);
+		mPublicKeys.insert(link.remote, pubKey);
+	}
+
 	std::unique_lock<std::recursive_mutex> lock(mListenersMutex);
 
 	auto it = mListeners.find(IdentifierPair(link.remote, link.local));
@@ -1280,7 +1431,7 @@ bool Network::Subscriber::fetch(const Locator &locator, const BinaryString &targ
 	}
 
 	// Schedule fetch task
-	Network::Instance->mPool.enqueue([this, locator, target, fetchContent]()
+	Network::Instance->mPool.post([this, locator, target, fetchContent]()
 	{
 		try {
 			Resource resource(target);
@@ -1302,6 +1453,11 @@ bool Network::Subscriber::fetch(const Locator &locator, const BinaryString &targ
 	return false;
 }
 
+void Network::Subscriber::schedule(std::function<void()> task)
+{
+	Network::Instance->mPool.post(std::move(task));
+}
+
 Network::RemotePublisher::RemotePublisher(const List<BinaryString> targets, const Link &link) :
 	Publisher(link),
 	mTargets(targets)
@@ -1466,6 +1622,15 @@ Network::Tunneler::~Tunneler(void)
 
 	mCondition.notify_all();
 	mThread.join();
+
+	Map<BinaryString, sptr<Session> > sessions;
+	{
+		std::unique_lock<std::mutex> lock(mTunnelsMutex);
+		sessions.swap(mSessions);
+	}
+
+	for(auto &p : sessions)
+		p.second->stop();
 }
 
 bool Network::Tunneler::open(const BinaryString &node, const Identifier &remote, User *user)
@@ -1480,15 +1645,47 @@ bool Network::Tunneler::open(const BinaryString &node, const Identifier &remote,
 	if(Network::Instance->overlay()->connectionsCount() == 0)
 		return false;
 
-	if(Network::Instance->hasLink(Link(user->identifier(), remote, node)))
+	Identifier local = user->identifier();
+	if(Network::Instance->hasLink(Link(local, remote, node)))
 		return false;
 
+	sptr<Session> session;
 	{
 		std::unique_lock<std::mutex> lock(mTunnelsMutex);
 		if(mPending.contains(node))
 			return false;
+
+		auto it = mLegacyNodes.find(node);
+		if(it != mLegacyNodes.end())
+		{
+			if(Time::Now() < it->second)
+			{
+				lock.unlock();
+				return openTunnel(node, remote, user);
+			}
+
+			mLegacyNodes.erase(it);
+		}
+
+		if(mPendingSessions.contains(node))
+			return false;
+
+		mSessions.get(node, session);
 	}
 
+	if(!session)
+		return openSession(node, local, remote);
+
+	mPool.enqueue([session, local, remote]()
+	{
+		session->open(local, remote);
+	});
+
+	return true;
+}
+
+bool Network::Tunneler::openTunnel(const BinaryString &node, const Identifier &remote, User *user)
+{
 	mPool.enqueue([this, node, remote, user]()
 	{
 		uint64_t tunnelId = 0;
@@ -1519,6 +1716,9 @@ bool Network::Tunneler::open(const BinaryString &node, const Identifier &remote,
 				// Set remote name
 				transport->setHostname(remote.toString());
 
+				// Resume previous session for the same link
+				transport->setSessionKey(node + local + remote);
+
 				// Add certificates
 				//LogDebug("Network::Tunneler::open", "Setting certificate credentials: " + user->name());
 				transport->addCredentials(user->certificate().get(), false);
@@ -1539,7 +1739,52 @@ bool Network::Tunneler::open(const BinaryString &node, const Identifier &remote,
 	return true;
 }
 
-SecureTransport *Network::Tunneler::listen(BinaryString *source)
+bool Network::Tunneler::openSession(const BinaryString &node, const Identifier &local, const Identifier &remote)
+{
+	mPool.enqueue([this, node, local, remote]()
+	{
+		uint64_t tunnelId = 0;
+		Random().readBinary(tunnelId);	// Generate random tunnel ID
+
+		SecureTransport *transport = NULL;
+		{
+			std::unique_lock<std::mutex> lock(mTunnelsMutex);
+			if(mPendingSessions.contains(node) || mSessions.contains(node))
+				return false;
+
+			mPendingSessions.insert(node, tunnelId);
+			mOpeningSessions.insert(node);
+
+			Tunneler::Tunnel *tunnel = NULL;
+			try {
+				tunnel = new Tunneler::Tunnel(this, tunnelId, node, Overlay::Message::Mux);
+				transport = new SecureTransportClient(tunnel, NULL);
+				mTunnels.insert(tunnel->id(), tunnel);
+
+				// Resume previous session with the same node
+				transport->setSessionKey(BinaryString("mux:") + node);
+
+				// Sessions are authenticated with node certificates
+				transport->addCredentials(Network::Instance->overlay()->certificate().get(), false);
+			}
+			catch(...)
+			{
+				lock.unlock();	// tunnel will unregister
+				delete tunnel;
+				delete transport;
+				mPendingSessions.erase(node);
+				mOpeningSessions.erase(node);
+				throw;
+			}
+		}
+
+		return handshakeSession(transport, node, Link(local, remote, node));
+	});
+
+	return true;
+}
+
+SecureTransport *Network::Tunneler::listen(BinaryString *source, bool *multiplexed)
 {
 	while(true)
 	{
@@ -1558,6 +1803,7 @@ SecureTransport *Network::Tunneler::listen(BinaryString *source)
 		}
 
 		const BinaryString &node = message.source;
+		QueueAccount.release(message.content.size(), node.toString());
 
 		// Read tunnel ID
 		uint64_t tunnelId = 0;
@@ -1579,32 +1825,49 @@ SecureTransport *Network::Tunneler::listen(BinaryString *source)
 				tunnel->incoming(message);
 			}
 			else {
-				auto it = mPending.find(node);
-				if(it != mPending.end() && it->second >= tunnelId)
-					continue;
+				bool mux = (message.type == Overlay::Message::Mux);
+				Map<BinaryString, uint64_t> &pending = (mux ? mPendingSessions : mPending);
+
+				auto it = pending.find(node);
+				if(it != pending.end())
+				{
+					if(mux && mOpeningSessions.contains(node))
+					{
+						// Both sides are opening, the session whose client has the lower node ID survives
+						if(Network::Instance->overlay()->localNode() < node)
+							continue;
 
-				mPending.insert(node, tunnelId);
+						mOpeningSessions.erase(node);	// ours will be ignored by the remote node
+					}
+					else if(it->second >= tunnelId)
+						continue;
+				}
 
-				LogDebug("Network::Tunneler::listen", "Incoming tunnel from " + node.toString() + ": " + String::hexa(tunnelId));
+				pending.insert(node, tunnelId);
+
+				LogDebug("Network::Tunneler::listen", String(mux ? "Incoming session from " : "Incoming tunnel from ") + node.toString() + ": " + String::hexa(tunnelId));
 
 				SecureTransport *transport = NULL;
 				try {
-					tunnel = new Tunneler::Tunnel(this, tunnelId, node);
+					tunnel = new Tunneler::Tunnel(this, tunnelId, node, message.type);
 					transport = new SecureTransportServer(tunnel, NULL, true);	// ask for certificate
 					mTunnels.insert(tunnel->id(), tunnel);
+
+					if(mux) transport->addCredentials(Network::Instance->overlay()->certificate().get(), false);
 				}
 				catch(...)
 				{
 					lock.unlock();	// tunnel will unregister
 					delete tunnel;
 					delete transport;
-					mPending.erase(node);
+					pending.erase(node);
 					throw;
 				}
 
 				tunnel->incoming(message);
 
 				if(source) *source = node;
+				if(multiplexed) *multiplexed = mux;
 				return transport;
 			}
 		}
@@ -1615,6 +1878,10 @@ SecureTransport *Network::Tunneler::listen(BinaryString *source)
 
 bool Network::Tunneler::incoming(const Overlay::Message &message)
 {
+	// Drop the message if the remote node fills its share of the budget
+	if(!QueueAccount.acquire(message.content.size(), message.source.toString()))
+		return false;
+
 	{
 		std::unique_lock<std::mutex> lock(mMutex);
 		mQueue.push(message);
@@ -1643,6 +1910,37 @@ void Network::Tunneler::removePending(const BinaryString &node)
 	mPending.erase(node);
 }
 
+void Network::Tunneler::registerSession(sptr<Session> session)
+{
+	Assert(session);
+
+	sptr<Session> previous;
+	{
+		std::unique_lock<std::mutex> lock(mTunnelsMutex);
+		mSessions.get(session->node(), previous);
+		mSessions.insert(session->node(), session);
+		mPendingSessions.erase(session->node());
+		mOpeningSessions.erase(session->node());
+	}
+
+	// The remote node restarted
+	if(previous) previous->stop();
+
+	session->start();
+}
+
+void Network::Tunneler::unregisterSession(Session *session)
+{
+	sptr<Session> tmp;	// session must not be deleted under lock
+	std::unique_lock<std::mutex> lock(mTunnelsMutex);
+	auto it = mSessions.find(session->node());
+	if(it != mSessions.end() && it->second.get() == session)
+	{
+		tmp = it->second;
+		mSessions.erase(it);
+	}
+}
+
 bool Network::Tunneler::handshake(SecureTransport *transport, const Link &link)
 {
 	Assert(!link.node.empty());
@@ -1760,6 +2058,108 @@ bool Network::Tunneler::handshake(SecureTransport *transport, const Link &link)
 	}
 }
 
+bool Network::Tunneler::handshakeSession(SecureTransport *transport, const BinaryString &node, const Link &link)
+{
+	Assert(!node.empty());
+
+	class MyVerifier : public SecureTransport::Verifier
+	{
+	public:
+		BinaryString node;
+
+		bool verifyPublicKey(const std::vector<Rsa::PublicKey> &chain)
+		{
+			if(chain.empty()) return false;
+
+			// The certificate must match the node the tunnel comes from
+			return chain[0].fingerprint<Sha3_256>() == node;
+		}
+	};
+
+	try {
+		mPool.enqueue([transport, node, link, this]()
+		{
+			bool isClient = transport->isClient();
+			bool fallback = false;
+
+			try {
+				MyVerifier verifier;
+				verifier.node = node;
+				transport->setVerifier(&verifier);
+
+				// Leave room for the channel ID
+				transport->setDatagramMtu(TunnelMtu + sizeof(uint64_t));
+
+				duration timeout = milliseconds(Config::Get("request_timeout").toDouble());
+				transport->setHandshakeTimeout(timeout);
+
+				transport->handshake();
+				Assert(transport->hasCertificate());
+
+				LogDebug("Network::Tunneler::handshakeSession", "Session established with " + node.toString());
+
+				sptr<Session> session = std::make_shared<Session>(this, transport, node);
+				registerSession(session);
+
+				if(!link.local.empty() && !link.remote.empty())
+					session->open(link.local, link.remote);
+
+				return true;
+			}
+			catch(const Timeout &e)
+			{
+				std::unique_lock<std::mutex> lock(mTunnelsMutex);
+
+				// Node probably does not support sessions, fall back to a tunnel per link,
+				// unless the open lost against a concurrent one or a session was registered meanwhile
+				if(isClient && mOpeningSessions.contains(node) && !mSessions.contains(node))
+				{
+					LogDebug("Network::Tunneler::handshakeSession", "Session timeout, falling back to tunnels for " + node.toString());
+
+					mLegacyNodes.insert(node, Time::Now() + LegacyRetryPeriod);
+					fallback = true;
+				}
+			}
+			catch(const std::exception &e)
+			{
+				LogInfo("Network::Tunneler::handshakeSession", String("Handshake failed: ") + e.what());
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mTunnelsMutex);
+
+				// A client which lost against a concurrent open no longer owns the pending entry
+				if(!isClient || mOpeningSessions.contains(node))
+					mPendingSessions.erase(node);
+
+				if(isClient) mOpeningSessions.erase(node);
+			}
+
+			delete transport;
+
+			if(fallback && !link.local.empty() && !link.remote.empty())
+			{
+				sptr<User> user = User::GetByIdentifier(link.local);
+				if(user) open(node, link.remote, user.get());
+			}
+
+			return false;
+		});
+
+		return true;
+	}
+	catch(const std::exception &e)
+	{
+		LogError("Network::Tunneler::handshakeSession", e.what());
+		std::unique_lock<std::mutex> lock(mTunnelsMutex);
+		mPendingSessions.erase(node);
+		if(transport->isClient()) mOpeningSessions.erase(node);
+		lock.unlock();
+		delete transport;
+		return false;
+	}
+}
+
 void Network::Tunneler::run(void)
 {
 	LogDebug("Network::Tunneler::run", "Starting tunneler");
@@ -1768,10 +2168,12 @@ void Network::Tunneler::run(void)
 	{
 		try {
 			Identifier node;
-			SecureTransport *transport = listen(&node);
+			bool multiplexed = false;
+			SecureTransport *transport = listen(&node, &multiplexed);
 			if(!transport) break;
 
-			handshake(transport, Link(Identifier::Empty, Identifier::Empty, node));
+			if(multiplexed) handshakeSession(transport, node, Link(Identifier::Empty, Identifier::Empty, node));
+			else handshake(transport, Link(Identifier::Empty, Identifier::Empty, node));
 		}
 		catch(const std::exception &e)
 		{
@@ -1782,10 +2184,12 @@ void Network::Tunneler::run(void)
 	LogWarn("Network::Tunneler::run", "Closing tunneler");
 }
 
-Network::Tunneler::Tunnel::Tunnel(Tunneler *tunneler, uint64_t id, const BinaryString &node) :
+Network::Tunneler::Tunnel::Tunnel(Tunneler *tunneler, uint64_t id, const BinaryString &node, uint8_t type) :
 	mTunneler(tunneler),
 	mId(id),
 	mNode(node),
+	mType(type),
+	mPeer(node.toString()),
 	mOffset(0),
 	mTimeout(milliseconds(Config::Get("idle_timeout").toDouble())),
 	mClosed(false)
@@ -1806,6 +2210,12 @@ Network::Tunneler::Tunnel::~Tunnel(void)
 	mCondition.notify_all();
 	std::this_thread::sleep_for(seconds(1.));
 	std::unique_lock<std::mutex> lock(mMutex);
+
+	while(!mQueue.empty())
+	{
+		QueueAccount.release(mQueue.front().content.size(), mPeer);
+		mQueue.pop();
+	}
 }
 
 uint64_t Network::Tunneler::Tunnel::id(void) const
@@ -1864,7 +2274,12 @@ bool Network::Tunneler::Tunnel::waitData(duration timeout)
 bool Network::Tunneler::Tunnel::nextRead(void)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
-	if(!mQueue.empty()) mQueue.pop();
+	if(!mQueue.empty())
+	{
+		QueueAccount.release(mQueue.front().content.size(), mPeer);
+		mQueue.pop();
+	}
+
 	mOffset = 0;
 	return true;
 }
@@ -1873,7 +2288,7 @@ bool Network::Tunneler::Tunnel::nextWrite(void)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
 
-	Network::Instance->overlay()->send(Overlay::Message(Overlay::Message::Tunnel, mBuffer, mNode));
+	Network::Instance->overlay()->send(Overlay::Message(mType, mBuffer, mNode));
 
 	mBuffer.clear();
 	mBuffer.writeBinary(mId);
@@ -1887,12 +2302,13 @@ bool Network::Tunneler::Tunnel::isDatagram(void) const
 
 bool Network::Tunneler::Tunnel::incoming(const Overlay::Message &message)
 {
-	if(message.type != Overlay::Message::Tunnel)
+	if(message.type != mType)
 		return false;
 
 	{
 		std::unique_lock<std::mutex> lock(mMutex);
 		if(mClosed) return false;
+		if(!QueueAccount.acquire(message.content.size(), mPeer)) return false;
 		mQueue.push(message);
 	}
 
@@ -1900,34 +2316,530 @@ bool Network::Tunneler::Tunnel::incoming(const Overlay::Message &message)
 	return true;
 }
 
-Network::Handler::Handler(Stream *stream, const Link &link) :
-	mStream(stream),
-	mLink(link),
-	mTokens(DefaultTokens),
-	mAvailableTokens(DefaultTokens),
-	mThreshold(DefaultThreshold),
-	mAccumulator(0.),
-	mLocalSideSequence(0.),
-	mRedundancy(DefaultRedundancy),
-	mLocalSideSeen(0),
-	mLocalSideCount(0),
-	mSideSeen(0),
-	mSideCount(0),
-	mCongestion(false),
-	mTimeout(milliseconds(Config::Get("retransmit_timeout").toDouble())),
-	mKeepaliveTimeout(milliseconds(Config::Get("keepalive_timeout").toDouble())),
-	mIdleTimeout(milliseconds(Config::Get("idle_timeout").toDouble())),
+Network::Tunneler::Channel::Channel(sptr<Session> session, uint64_t id) :
+	mSession(session),
+	mId(id),
+	mPeer(session->node().toString()),
+	mOffset(0),
+	mTimeout(milliseconds(Config::Get("idle_timeout").toDouble())),
 	mClosed(false)
 {
-	Assert(mStream);
+	Assert(mSession);
+}
 
-	// Set timeout alarm
-	mTimeoutAlarm.set([this]()
-	{
-		//LogDebug("Network::Handler", "Triggered timeout");
-		std::unique_lock<std::mutex> lock(mMutex);
-		send(true);
-	});
+Network::Tunneler::Channel::~Channel(void)
+{
+	NOEXCEPTION(close());
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(!mQueue.empty())
+	{
+		QueueAccount.release(mQueue.front().size(), mPeer);
+		mQueue.pop();
+	}
+}
+
+uint64_t Network::Tunneler::Channel::id(void) const
+{
+	return mId;
+}
+
+size_t Network::Tunneler::Channel::readData(char *buffer, size_t size)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	mCondition.wait_for(lock, mTimeout, [this]() {
+		return mClosed || !mQueue.empty();
+	});
+
+	if(mClosed) return 0;
+	if(mQueue.empty()) throw Timeout();
+
+	const BinaryString &datagram = mQueue.front();
+	Assert(mOffset <= datagram.size());
+
+	size = std::min(size, size_t(datagram.size() - mOffset));
+	std::copy(datagram.data() + mOffset, datagram.data() + mOffset + size, buffer);
+	mOffset+= size;
+	return size;
+}
+
+void Network::Tunneler::Channel::writeData(const char *data, size_t size)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mBuffer.writeBinary(data, size);
+}
+
+bool Network::Tunneler::Channel::waitData(duration timeout)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	return mCondition.wait_for(lock, timeout, [this]() {
+		return mClosed || !mQueue.empty();
+	});
+}
+
+bool Network::Tunneler::Channel::nextRead(void)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	if(!mQueue.empty())
+	{
+		QueueAccount.release(mQueue.front().size(), mPeer);
+		mQueue.pop();
+	}
+
+	mOffset = 0;
+	return true;
+}
+
+bool Network::Tunneler::Channel::nextWrite(void)
+{
+	BinaryString buffer;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mClosed) return false;
+		buffer.swap(mBuffer);
+	}
+
+	mSession->send(mId, buffer);
+	return true;
+}
+
+bool Network::Tunneler::Channel::isDatagram(void) const
+{
+	return true;
+}
+
+void Network::Tunneler::Channel::close(void)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mClosed) return;
+		mClosed = true;
+	}
+
+	mCondition.notify_all();
+	mSession->closeChannel(mId, true);
+}
+
+bool Network::Tunneler::Channel::incoming(const BinaryString &datagram)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mClosed) return false;
+		if(!QueueAccount.acquire(datagram.size(), mPeer)) return false;
+		mQueue.push(datagram);
+	}
+
+	mCondition.notify_all();
+	return true;
+}
+
+void Network::Tunneler::Channel::hangup(void)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mClosed = true;
+	}
+
+	mCondition.notify_all();
+}
+
+Network::Tunneler::Session::Session(Tunneler *tunneler, SecureTransport *transport, const BinaryString &node) :
+	mTunneler(tunneler),
+	mTransport(transport),
+	mNode(node),
+	mNextChannelId(transport->isClient() ? 1 : 2),	// client side opens odd channels, server side even ones
+	mStopped(false)
+{
+	Assert(mTunneler);
+	Assert(mTransport);
+}
+
+Network::Tunneler::Session::~Session(void)
+{
+	stop();
+
+	if(mThread.get_id() == std::this_thread::get_id()) mThread.detach();
+	else if(mThread.joinable()) mThread.join();
+
+	delete mTransport;
+}
+
+BinaryString Network::Tunneler::Session::node(void) const
+{
+	return mNode;
+}
+
+void Network::Tunneler::Session::start(void)
+{
+	mThread = std::thread([this]()
+	{
+		run();
+
+		mTunneler->unregisterSession(this);
+	});
+}
+
+void Network::Tunneler::Session::stop(void)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mStopped = true;
+	}
+
+	mCondition.notify_all();
+}
+
+bool Network::Tunneler::Session::open(const Identifier &local, const Identifier &remote)
+{
+	sptr<User> user = User::GetByIdentifier(local);
+	if(!user) return false;
+
+	Link link(local, remote, mNode);
+	if(Network::Instance->hasLink(link))
+		return false;
+
+	BinaryString nonce;
+	Random().readBinary(nonce, 16);
+
+	uint64_t id = 0;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mStopped) return false;
+
+		for(const auto &p : mOpenings)
+			if(p.second.link == link)
+				return false;
+
+		id = mNextChannelId;
+		mNextChannelId+= 2;
+
+		Opening opening;
+		opening.link = link;
+		opening.nonce = nonce;
+		mOpenings.insert(id, opening);
+	}
+
+	// The signature binds the user pair to both nodes, so it can't be replayed in another session
+	BinaryString signature;
+	user->privateKey().sign<Sha256>(Binding("open", Network::Instance->overlay()->localNode(), mNode, id, local, remote, nonce), signature);
+
+	BinaryString record;
+	BinarySerializer serializer(&record);
+	serializer << uint8_t(OpenChannel) << id << remote << user->publicKey() << nonce << signature;
+
+	Time deadline = Time::Now() + milliseconds(Config::Get("request_timeout").toDouble());
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(!mStopped && mOpenings.contains(id) && Time::Now() < deadline)
+	{
+		// Send again until accepted as records may be lost
+		lock.unlock();
+		send(0, record);
+		lock.lock();
+
+		mCondition.wait_for(lock, seconds(1.), [this, id]() {
+			return mStopped || !mOpenings.contains(id);
+		});
+	}
+
+	mOpenings.erase(id);
+	return mChannels.contains(id);
+}
+
+void Network::Tunneler::Session::send(uint64_t channel, const BinaryString &payload)
+{
+	std::unique_lock<std::mutex> lock(mWriteMutex);
+	mTransport->writeBinary(channel);
+	mTransport->writeBinary(payload.data(), payload.size());
+	mTransport->nextWrite();
+}
+
+void Network::Tunneler::Session::closeChannel(uint64_t id, bool notify)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mAccepts.erase(id);
+		if(!mChannels.erase(id) || mStopped)
+			return;
+	}
+
+	if(notify)
+	{
+		BinaryString record;
+		BinarySerializer serializer(&record);
+		serializer << uint8_t(CloseChannel) << id;
+		NOEXCEPTION(send(0, record));
+	}
+}
+
+BinaryString Network::Tunneler::Session::Binding(const String &label,
+	const BinaryString &openerNode, const BinaryString &acceptorNode,
+	uint64_t channel, const Identifier &opener, const Identifier &acceptor,
+	const BinaryString &nonce)
+{
+	BinaryString message;
+	BinarySerializer serializer(&message);
+	serializer << label << openerNode << acceptorNode << channel << opener << acceptor << nonce;
+	return Sha256().compute(message);
+}
+
+void Network::Tunneler::Session::run(void)
+{
+	duration idleTimeout = milliseconds(Config::Get("idle_timeout").toDouble());
+	Time last = Time::Now();
+	char buffer[BufferSize];
+
+	try {
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				if(mStopped) break;
+
+				// Close the session once there is no channel left
+				if(mChannels.empty() && mOpenings.empty() && Time::Now() - last >= idleTimeout)
+					break;
+			}
+
+			if(!mTransport->waitData(seconds(1.)))
+				continue;
+
+			size_t size = mTransport->readData(buffer, BufferSize);
+			mTransport->nextRead();
+			if(!size) break;
+
+			last = Time::Now();
+
+			BinaryString datagram(buffer, size);
+			uint64_t channel = 0;
+			if(!datagram.readBinary(channel))
+				continue;
+
+			if(channel == 0)
+			{
+				control(datagram);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mMutex);
+			auto it = mChannels.find(channel);
+			if(it != mChannels.end())
+				it->second->incoming(datagram);
+		}
+	}
+	catch(const std::exception &e)
+	{
+		LogDebug("Network::Tunneler::Session", String("Session closed: ") + e.what());
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mStopped = true;
+
+		for(auto &p : mChannels)
+			p.second->hangup();
+
+		mChannels.clear();
+		mOpenings.clear();
+		mAccepts.clear();
+	}
+
+	mCondition.notify_all();
+}
+
+void Network::Tunneler::Session::control(BinaryString &record)
+{
+	BinarySerializer serializer(&record);
+
+	uint8_t type = 0;
+	uint64_t id = 0;
+	if(!(serializer >> type) || !(serializer >> id) || id == 0)
+		return;
+
+	switch(type)
+	{
+	case OpenChannel:
+		{
+			Identifier local;
+			Rsa::PublicKey publicKey;
+			BinaryString nonce, signature;
+			serializer >> local >> publicKey >> nonce >> signature;
+			if(serializer) accept(id, local, publicKey, nonce, signature);
+			break;
+		}
+
+	case AcceptChannel:
+		{
+			Rsa::PublicKey publicKey;
+			BinaryString signature;
+			serializer >> publicKey >> signature;
+			if(serializer) accepted(id, publicKey, signature);
+			break;
+		}
+
+	case CloseChannel:
+		{
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mOpenings.erase(id);
+				mAccepts.erase(id);
+
+				auto it = mChannels.find(id);
+				if(it != mChannels.end())
+				{
+					it->second->hangup();
+					mChannels.erase(it);
+				}
+			}
+
+			mCondition.notify_all();
+			break;
+		}
+
+	default:
+		LogDebug("Network::Tunneler::Session", "Unknown control record: " + String::number(unsigned(type)));
+		break;
+	}
+}
+
+void Network::Tunneler::Session::accept(uint64_t id, const Identifier &local, const Rsa::PublicKey &publicKey, const BinaryString &nonce, const BinaryString &signature)
+{
+	// Channels opened remotely have the other parity
+	if((id & 1) == (mNextChannelId & 1))
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mStopped || mChannels.contains(id))
+		{
+			// Accept record was lost, send it again
+			BinaryString record;
+			if(mAccepts.get(id, record))
+			{
+				lock.unlock();
+				send(0, record);
+			}
+			return;
+		}
+	}
+
+	Identifier remote = publicKey.fingerprint<Sha3_256>();
+	BinaryString localNode = Network::Instance->overlay()->localNode();
+	if(!publicKey.verify<Sha256>(Binding("open", mNode, localNode, id, remote, local, nonce), signature))
+	{
+		LogDebug("Network::Tunneler::Session", "Invalid channel signature from " + remote.toString());
+		return;
+	}
+
+	Link link(local, remote, mNode);
+
+	// Always accept, as for tunnels
+	Network::Instance->onAuth(link, publicKey);
+
+	BinaryString record;
+	BinarySerializer serializer(&record);
+
+	sptr<User> user = User::GetByIdentifier(local);
+	if(!user)
+	{
+		LogDebug("Network::Tunneler::Session", "User does not exist: " + local.toString());
+		serializer << uint8_t(CloseChannel) << id;
+		send(0, record);
+		return;
+	}
+
+	BinaryString acceptSignature;
+	user->privateKey().sign<Sha256>(Binding("accept", mNode, localNode, id, remote, local, nonce), acceptSignature);
+	serializer << uint8_t(AcceptChannel) << id << user->publicKey() << acceptSignature;
+
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mAccepts.insert(id, record);
+	}
+
+	send(0, record);
+	attach(id, link);
+}
+
+void Network::Tunneler::Session::accepted(uint64_t id, const Rsa::PublicKey &publicKey, const BinaryString &signature)
+{
+	Opening opening;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(!mOpenings.get(id, opening))
+			return;
+	}
+
+	const Link &link = opening.link;
+	if(publicKey.fingerprint<Sha3_256>() != link.remote)
+		return;
+
+	BinaryString localNode = Network::Instance->overlay()->localNode();
+	if(!publicKey.verify<Sha256>(Binding("accept", localNode, mNode, id, link.local, link.remote, opening.nonce), signature))
+	{
+		LogDebug("Network::Tunneler::Session", "Invalid channel signature from " + link.remote.toString());
+		return;
+	}
+
+	Network::Instance->onAuth(link, publicKey);
+	attach(id, link);
+}
+
+bool Network::Tunneler::Session::attach(uint64_t id, const Link &link)
+{
+	Channel *channel = NULL;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mStopped || mChannels.contains(id))
+			return false;
+
+		channel = new Channel(shared_from_this(), id);
+		mChannels.insert(id, channel);
+		mOpenings.erase(id);
+	}
+
+	mCondition.notify_all();
+
+	LogDebug("Network::Tunneler::Session", "Channel opened for " + link.local.toString() + " <-> " + link.remote.toString());
+
+	// Each channel has its own handler, hence its own flow control
+	sptr<Handler> handler = std::make_shared<Handler>(channel, link);
+	Network::Instance->registerHandler(link, handler);
+	return true;
+}
+
+Network::Handler::Handler(Stream *stream, const Link &link) :
+	mStream(stream),
+	mLink(link),
+	mPeer(link.node.toString()),
+	mTokens(DefaultTokens),
+	mAvailableTokens(DefaultTokens),
+	mThreshold(DefaultThreshold),
+	mAccumulator(0.),
+	mLocalSideSequence(0.),
+	mRedundancy(DefaultRedundancy),
+	mLocalSideSeen(0),
+	mLocalSideCount(0),
+	mSideSeen(0),
+	mSideCount(0),
+	mCongestion(false),
+	mTimeout(milliseconds(Config::Get("retransmit_timeout").toDouble())),
+	mKeepaliveTimeout(milliseconds(Config::Get("keepalive_timeout").toDouble())),
+	mIdleTimeout(milliseconds(Config::Get("idle_timeout").toDouble())),
+	mRecordVersion(0),
+	mClosed(false)
+{
+	Assert(mStream);
+
+	// Set timeout alarm
+	mTimeoutAlarm.set([this]()
+	{
+		//LogDebug("Network::Handler", "Triggered timeout");
+		std::unique_lock<std::mutex> lock(mMutex);
+		send(true);
+	});
 
 	// Set acknowledge alarm
 	mAcknowledgeAlarm.set([this]()
@@ -1964,10 +2876,15 @@ Network::Handler::~Handler(void)
 	// Delete stream
 	std::unique_lock<std::mutex> lock(mMutex);
 	delete mStream;
+
+	SourceAccount.release(uint64_t(mSource.rank())*Fountain::ChunkSize, mPeer);
 }
 
 void Network::Handler::start(void)
 {
+	// Announce supported record version, older peers ignore unknown record types
+	write("version", Object().insert("records", unsigned(RecordVersion)));
+
 	// Start handler thread
 	mThread = std::thread([this]()
 	{
@@ -1995,9 +2912,8 @@ void Network::Handler::stop(void)
 
 void Network::Handler::write(const String &type, const Serializable &content)
 {
-	String serialized;
-	JsonSerializer(&serialized) << content;
-	write(type, serialized);
+	std::unique_lock<std::mutex> lock(mMutex);
+	writeRecord(type, content);
 }
 
 void Network::Handler::write(const String &type, const String &record)
@@ -2051,16 +2967,52 @@ Network::Link Network::Handler::link(void) const
 	return mLink;
 }
 
-bool Network::Handler::readRecord(String &type, String &record)
+bool Network::Handler::HasBinaryEncoding(const String &type)
+{
+	// Only control records handled by Network itself have a fixed schema
+	return (type == "pull" || type == "push" || type == "publish" || type == "subscribe" || type == "invite");
+}
+
+bool Network::Handler::readRecord(String &type, BinaryString &record, bool &binary)
 {
 	if(mClosed) return false;
 
 	try {
-		if(readString(type))
+		uint8_t first;
+		if(!readBinary(first)) return false;
+
+		if(first & 0x80)
 		{
-			AssertIO(readString(record));
+			// Length-prefixed record, type strings never start with such a byte
+			uint8_t version = first & 0x7F;
+			AssertIO(version >= 1 && version <= RecordVersion);
+
+			uint8_t format = 0;
+			uint16_t typeSize = 0;
+			uint32_t recordSize = 0;
+			AssertIO(readBinary(format));
+			AssertIO(readBinary(typeSize));
+			AssertIO(readBinary(recordSize));
+
+			type.resize(typeSize);
+			record.resize(recordSize);
+			AssertIO(readBinary(&type[0], typeSize) == typeSize);
+			AssertIO(readBinary(&record[0], recordSize) == recordSize);
+			binary = (format == BinaryRecord);
 			return true;
 		}
+
+		// Legacy NUL-terminated record
+		type.clear();
+		if(first)
+		{
+			AssertIO(readString(type));
+			type.insert(type.begin(), char(first));
+		}
+
+		AssertIO(readString(record));
+		binary = false;
+		return true;
 	}
 	catch(std::exception &e)
 	{
@@ -2073,19 +3025,47 @@ bool Network::Handler::readRecord(String &type, String &record)
 
 void Network::Handler::writeRecord(const String &type, const Serializable &content, bool dontsend)
 {
-	String serialized;
-	JsonSerializer(&serialized) << content;
-	writeRecord(type, serialized, dontsend);
+	if(mRecordVersion && HasBinaryEncoding(type))
+	{
+		BinaryString serialized;
+		BinarySerializer(&serialized) << content;
+		writeFramed(type, serialized.data(), serialized.size(), BinaryRecord, dontsend);
+	}
+	else {
+		String serialized;
+		JsonSerializer(&serialized) << content;
+		writeRecord(type, serialized, dontsend);
+	}
 }
 
 void Network::Handler::writeRecord(const String &type, const String &record, bool dontsend)
 {
+	if(mRecordVersion)
+	{
+		writeFramed(type, record.data(), record.size(), JsonRecord, dontsend);
+		return;
+	}
+
 	writeString(type);
 	writeString(record);
 	flush(dontsend);
 }
 
-bool Network::Handler::readString(String &str)
+void Network::Handler::writeFramed(const String &type, const char *data, size_t size, RecordFormat format, bool dontsend)
+{
+	Assert(type.size() <= std::numeric_limits<uint16_t>::max());
+	Assert(size <= std::numeric_limits<uint32_t>::max());
+
+	writeBinary(uint8_t(0x80 | mRecordVersion));
+	writeBinary(uint8_t(format));
+	writeBinary(uint16_t(type.size()));
+	writeBinary(uint32_t(size));
+	writeBinary(type.data(), type.size());
+	writeBinary(data, size);
+	flush(dontsend);
+}
+
+bool Network::Handler::readString(std::string &str)
 {
 	str.clear();
 
@@ -2142,7 +3122,9 @@ size_t Network::Handler::readData(char *buffer, size_t size)
 			else {
 				//LogDebug("Network::Handler::recvCombination", "Received side combination (target=" + target.toString() + ")");
 
-				if(Store::Instance->push(target, combination))
+				Network::Instance->delivered(mLink, target);
+
+				if(Store::Instance->push(target, combination, mLink.node))
 					Network::Instance->unregisterAllCallers(target);
 			}
 
@@ -2180,6 +3162,7 @@ void Network::Handler::flush(bool dontsend)
 	if(!mSourceBuffer.empty())
 	{
 		unsigned count = mSource.write(mSourceBuffer.data(), mSourceBuffer.size());
+		SourceAccount.charge(uint64_t(count)*Fountain::ChunkSize, mPeer);	// can't be refused, congestion control limits it
 		mAccumulator+= mRedundancy*count;
 		mSourceBuffer.clear();
 	}
@@ -2244,6 +3227,7 @@ bool Network::Handler::recvCombination(BinaryString &target, Fountain::Combinati
 
 		// Compute received
 		unsigned flowReceived = mSource.drop(nextSeen);
+		SourceAccount.release(uint64_t(flowReceived)*Fountain::ChunkSize, mPeer);
 		unsigned sideReceived = sideSeen - std::min(mSideSeen, sideSeen);
 		unsigned received = flowReceived + sideReceived;
 
@@ -2428,12 +3412,33 @@ void Network::Handler::run(void)
 	LogDebug("Network::Handler", "Starting handler");
 
 	try {
-		String type, record;
-		while(readRecord(type, record))
+		String type;
+		BinaryString record;
+		bool binary = false;
+		while(readRecord(type, record, binary))
 		{
 			try {
-				JsonSerializer serializer(&record);
-				Network::Instance->incoming(mLink, type, serializer);
+				if(binary)
+				{
+					// Read in place, consuming the string byte by byte would be quadratic
+					ByteArray array(&record[0], record.size());
+					BinarySerializer serializer(&array);
+					Network::Instance->incoming(mLink, type, serializer);
+				}
+				else if(type == "version")
+				{
+					unsigned version = 0;
+					JsonSerializer(&record) >> Object()
+						.insert("records", version);
+
+					std::unique_lock<std::mutex> lock(mMutex);
+					mRecordVersion = uint8_t(std::min(version, unsigned(RecordVersion)));
+					LogDebug("Network::Handler", "Using record version " + String::number(unsigned(mRecordVersion)));
+				}
+				else {
+					JsonSerializer serializer(&record);
+					Network::Instance->incoming(mLink, type, serializer);
+				}
 			}
 			catch(const std::exception &e)
 			{
@@ -2563,7 +3568,7 @@ void Network::Pusher::run(void)
 					BinarySerializer(&data.content) << combination;
 					data.content.writeBinary(combination.data(), combination.codedSize());
 
-					Network::Instance->overlay()->send(data);
+					Network::Instance->overlay()->send(std::move(data));
 				}
 
 				if(!tokens) list.pop_front();
@@ -35,6 +35,7 @@
 #include "pla/threadpool.hpp"
 #include "pla/scheduler.hpp"
 #include "pla/alarm.hpp"
+#include "pla/budget.hpp"
 #include "pla/map.hpp"
 #include "pla/array.hpp"
 
@@ -54,6 +55,9 @@ public:
 	static const double   DefaultPacketRate;
 	static const duration CallPeriod;
 	static const duration CallFallbackTimeout;
+	static const unsigned StalledPeriods;
+	static const unsigned MaxStalledBackoff;
+	static const uint8_t  RecordVersion;
 
 	static Network *Instance;
 
@@ -126,6 +130,7 @@ public:
 
 	protected:
 		bool fetch(const Locator &locator, const BinaryString &target, bool fetchContent = false);
+		void schedule(std::function<void()> task);	// run task on the network thread pool
 
 	private:
 		Link mLink;
@@ -214,6 +219,9 @@ public:
 	bool hasLink(const Link &link) const;
 	bool getLinkFromNode(const Identifier &node, Link &link) const;
 
+	// Public keys of local users and authenticated remote users
+	bool getPublicKey(const Identifier &identifier, Rsa::PublicKey &pubKey) const;
+
 	void sendCalls(void);
 	void sendBeacons(void);
 
@@ -243,9 +251,15 @@ private:
 		bool localOnly(void) const;
 	};
 
+	// Links to a node share a single secure session authenticated with node certificates,
+	// each user pair gets its own channel. Nodes not supporting sessions get one tunnel per link.
 	class Tunneler
 	{
 	public:
+		static const duration LegacyRetryPeriod;
+		static const uint64_t MaxPeerQueuedBytes;
+		static Budget::Account QueueAccount;	// bytes waiting in tunnel and channel queues
+
 		Tunneler(void);
 		~Tunneler(void);
 
@@ -255,10 +269,12 @@ private:
 		void run(void);
 
 	private:
+		class Session;
+
 		class Tunnel : public Stream
 		{
 		public:
-			Tunnel(Tunneler *tunneler, uint64_t id, const BinaryString &node);
+			Tunnel(Tunneler *tunneler, uint64_t id, const BinaryString &node, uint8_t type = Overlay::Message::Tunnel);
 			~Tunnel(void);
 
 			uint64_t id(void) const;
@@ -280,6 +296,8 @@ private:
 			Tunneler *mTunneler;
 			uint64_t mId;			// tunnel id
 			BinaryString mNode;
+			uint8_t mType;			// overlay message type
+			String mPeer;			// accounting key for mNode
 			Queue<Overlay::Message> mQueue;	// recv queue
 			size_t mOffset;			// read offset
 			BinaryString mBuffer;		// write buffer
@@ -290,16 +308,117 @@ private:
 			std::condition_variable mCondition;
 		};
 
+		// Channel carrying the records of a single link inside a session
+		class Channel : public Stream
+		{
+		public:
+			Channel(sptr<Session> session, uint64_t id);
+			~Channel(void);
+
+			uint64_t id(void) const;
+
+			// Stream
+			size_t readData(char *buffer, size_t size);
+			void writeData(const char *data, size_t size);
+			bool waitData(duration timeout);
+			bool nextRead(void);
+			bool nextWrite(void);
+			bool isDatagram(void) const;
+			void close(void);
+
+			bool incoming(const BinaryString &datagram);
+			void hangup(void);	// closed by remote, nothing is sent
+
+		private:
+			sptr<Session> mSession;
+			uint64_t mId;
+			String mPeer;			// accounting key for the session node
+			Queue<BinaryString> mQueue;	// recv queue
+			size_t mOffset;			// read offset
+			BinaryString mBuffer;		// write buffer
+			duration mTimeout;
+			bool mClosed;
+
+			mutable std::mutex mMutex;
+			std::condition_variable mCondition;
+		};
+
+		class Session : public std::enable_shared_from_this<Session>
+		{
+		public:
+			Session(Tunneler *tunneler, SecureTransport *transport, const BinaryString &node);
+			~Session(void);
+
+			BinaryString node(void) const;
+
+			void start(void);
+			void stop(void);
+			bool open(const Identifier &local, const Identifier &remote);	// blocks until accepted
+			void send(uint64_t channel, const BinaryString &payload);
+			void closeChannel(uint64_t id, bool notify);
+
+		private:
+			// Records on channel 0
+			enum Control : uint8_t
+			{
+				OpenChannel = 1,
+				AcceptChannel = 2,
+				CloseChannel = 3
+			};
+
+			struct Opening
+			{
+				Link link;
+				BinaryString nonce;
+			};
+
+			static BinaryString Binding(const String &label,
+				const BinaryString &openerNode, const BinaryString &acceptorNode,
+				uint64_t channel, const Identifier &opener, const Identifier &acceptor,
+				const BinaryString &nonce);
+
+			void run(void);
+			void control(BinaryString &record);
+			void accept(uint64_t id, const Identifier &local, const Rsa::PublicKey &publicKey, const BinaryString &nonce, const BinaryString &signature);
+			void accepted(uint64_t id, const Rsa::PublicKey &publicKey, const BinaryString &signature);
+			bool attach(uint64_t id, const Link &link);
+
+			Tunneler *mTunneler;
+			SecureTransport *mTransport;
+			BinaryString mNode;
+			uint64_t mNextChannelId;
+			bool mStopped;
+
+			Map<uint64_t, Channel*> mChannels;
+			Map<uint64_t, Opening> mOpenings;	// channels opened locally, waiting for accept
+			Map<uint64_t, BinaryString> mAccepts;	// accept records, sent again on duplicate open
+
+			std::thread mThread;
+			mutable std::mutex mMutex;
+			mutable std::mutex mWriteMutex;
+			std::condition_variable mCondition;
+		};
+
 		void registerTunnel(uint64_t id, Tunnel *tunnel);
 		void unregisterTunnel(uint64_t id);
 		void removePending(const BinaryString &node);
+		void registerSession(sptr<Session> session);
+		void unregisterSession(Session *session);
 
-		SecureTransport *listen(BinaryString *source);
+		SecureTransport *listen(BinaryString *source, bool *multiplexed);
+
+		bool openTunnel(const BinaryString &node, const Identifier &remote, User *user);
+		bool openSession(const BinaryString &node, const Identifier &local, const Identifier &remote);
 
 		bool handshake(SecureTransport *transport, const Link &link);
+		bool handshakeSession(SecureTransport *transport, const BinaryString &node, const Link &link);
 
 		Map<uint64_t, Tunnel*> mTunnels;		// Tunnels
 		Map<BinaryString, uint64_t> mPending;	// Pending nodes
+		Map<BinaryString, uint64_t> mPendingSessions;	// Pending session nodes
+		Set<BinaryString> mOpeningSessions;	// Pending session nodes opened as client
+		Map<BinaryString, sptr<Session> > mSessions;	// Sessions by node
+		Map<BinaryString, Time> mLegacyNodes;	// Nodes without session support, until retry time
 
 		mutable std::mutex mTunnelsMutex;
 
@@ -316,6 +435,8 @@ private:
 	class Handler : private Stream
 	{
 	public:
+		static Budget::Account SourceAccount;	// bytes of flow data not acknowledged yet
+
 		Handler(Stream *stream, const Link &link);
 		~Handler(void);
 
@@ -329,11 +450,22 @@ private:
 		Link link(void) const;
 
 	private:
-		bool readRecord(String &type, String &record);
+		// Records are NUL-terminated JSON until the remote announces a record version,
+		// then length-prefixed with a binary body for control types
+		enum RecordFormat : uint8_t
+		{
+			JsonRecord = 0,
+			BinaryRecord = 1
+		};
+
+		static bool HasBinaryEncoding(const String &type);
+
+		bool readRecord(String &type, BinaryString &record, bool &binary);
 		void writeRecord(const String &type, const Serializable &content, bool dontsend = false);
 		void writeRecord(const String &type, const String &record, bool dontsend = false);
+		void writeFramed(const String &type, const char *data, size_t size, RecordFormat format, bool dontsend);
 
-		bool readString(String &str);
+		bool readString(std::string &str);
 		void writeString(const String &str);
 
 		size_t readData(char *buffer, size_t size);
@@ -348,6 +480,7 @@ private:
 
 		Stream *mStream;
 		Link mLink;
+		String mPeer;	// accounting key for the remote node
 		Alarm mTimeoutAlarm;
 		Alarm mAcknowledgeAlarm;
 		Alarm mIdleAlarm;
@@ -367,6 +500,7 @@ private:
 		unsigned mLocalSideSeen, mLocalSideCount, mSideSeen, mSideCount;
 		bool mCongestion;
 		duration mTimeout, mKeepaliveTimeout, mIdleTimeout;
+		uint8_t mRecordVersion;	// negotiated, 0 for legacy records
 		bool mClosed;
 
 		std::thread mThread;
@@ -384,6 +518,10 @@ private:
 	bool directCall(const BinaryString &target, unsigned tokens);
 	bool fallbackCall(const BinaryString &target, unsigned tokens);
 
+	// Swarming
+	void delivered(const Link &link, const BinaryString &target);
+	void updateSwarms(void);
+
 	bool matchPublishers(const String &path, const Link &link, Subscriber *subscriber = NULL);
 	bool matchSubscribers(const String &path, const Link &link, Publisher *publisher);
 	bool matchSubscribers(const String &path, const Link &link, const Mail &mail);
@@ -406,6 +544,22 @@ private:
 	Map<IdentifierPair, Set<Listener*> > mListeners;
 	Map<Link, Map<String, sptr<RemoteSubscriber> > > mRemoteSubscribers;
 	Map<Identifier, List<Link> > mLinksFromNodes;
+	mutable Map<Identifier, Rsa::PublicKey> mPublicKeys;	// remote keys seen on authentication
+
+	// Source of a target in a swarming download
+	struct Source
+	{
+		Source(void) : rate(0.), received(0), requested(0), stalled(0), retries(0), backoff(0) {}
+
+		double rate;		// delivered combinations per second (moving average)
+		unsigned received;	// combinations received during the current period
+		unsigned requested;	// tokens still expected from the last pull
+		unsigned stalled;	// consecutive periods without delivery
+		unsigned retries;	// reallocations since the last delivery
+		unsigned backoff;	// periods to wait before the next reallocation
+	};
+
+	Map<BinaryString, Map<Link, Source> > mSwarms;
 
 	mutable std::recursive_mutex mHandlersMutex;	// recursive so listeners can call network on event
 	mutable std::recursive_mutex mListenersMutex;	// idem
@@ -414,6 +568,8 @@ private:
 	mutable std::mutex mRemoteSubscribersMutex;
 	mutable std::mutex mCallersMutex;
 	mutable std::mutex mLinksFromNodesMutex;
+	mutable std::mutex mSwarmsMutex;
+	mutable std::mutex mPublicKeysMutex;
 
 	std::thread mThread;
 
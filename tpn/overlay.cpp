@@ -46,6 +46,15 @@ namespace tpn
 const int Overlay::MaxQueueSize = 128;
 const int Overlay::StoreNeighbors = 3;
 const int Overlay::DefaultTtl = 16;
+const int Overlay::BucketSize = 20;
+const int Overlay::RetrieveAlpha = 3;
+const int Overlay::RetrieveQuorum = 2;
+const duration Overlay::RetrieveGrace = milliseconds(200.);
+const duration Overlay::RetrieveNegativeTimeout = seconds(10.);
+const int Overlay::MaxNegativeCacheSize = 1024;
+const int Overlay::MaxBatchSize = 1024;
+const duration Overlay::BatchDelay = milliseconds(100.);
+const uint8_t Overlay::ProtocolVersion = 1;	// version 1 supports Batch messages
 
 Overlay::Overlay(int port) :
 		mPool(2 + 5),
@@ -66,6 +75,11 @@ Overlay::Overlay(int port) :
 	// Generate local node id
 	mLocalNode = mPublicKey.fingerprint<Sha3_256>();
 
+	// Fill routing table with known peers
+	mRoutingTable.init(mLocalNode);
+	for(const auto &p : mKnownPeers)
+		mRoutingTable.insert(p.second, false);
+
 	// Create certificate
 	mCertificate = std::make_shared<SecureTransport::RsaCertificate>(mPublicKey, mPrivateKey, localNode().toString());
 
@@ -95,6 +109,11 @@ Overlay::Overlay(int port) :
 			b->run();
 		});
 
+	mBatchAlarm.set([this]()
+	{
+		flushBatches();
+	});
+
 	start(seconds(1.));
 }
 
@@ -232,6 +251,7 @@ bool Overlay::connect(const Set<Address> &addrs, const BinaryString &remote, boo
 								if(!remote.empty() && (it == mKnownPeers.end() || it->second != remote))
 								{
 									mKnownPeers.insert(addr, remote);
+									if(!mHandlers.contains(remote)) mRoutingTable.insert(remote, false);
 									changed = true;
 								}
 							}
@@ -243,10 +263,19 @@ bool Overlay::connect(const Set<Address> &addrs, const BinaryString &remote, boo
 							bool changed = false;
 							{
 								std::unique_lock<std::mutex> lock(mMutex);
-								if(mKnownPeers.contains(addr) && Random().uniform(0, 100) == 0)
+								auto it = mKnownPeers.find(addr);
+								if(it != mKnownPeers.end() && Random().uniform(0, 100) == 0)
 								{
-									mKnownPeers.erase(addr);
+									BinaryString node = it->second;
+									mKnownPeers.erase(it);
 									changed = true;
+
+									// Forget the node unless it is connected or still reachable at another address
+									bool known = mHandlers.contains(node);
+									for(auto jt = mKnownPeers.begin(); jt != mKnownPeers.end() && !known; ++jt)
+										known = (jt->second == node);
+
+									if(!known) mRoutingTable.erase(node);
 								}
 							}
 
@@ -330,14 +359,14 @@ bool Overlay::recv(Message &message, duration timeout)
 	if(mIncoming.empty())
 		return false;
 
-	message = mIncoming.front();
+	message = std::move(mIncoming.front());
 	mIncoming.pop();
 	return true;
 }
 
-bool Overlay::send(const Message &message)
+bool Overlay::send(Message message)
 {
-	return route(message);	// Alias
+	return route(std::move(message));	// Alias
 }
 
 void Overlay::store(const BinaryString &key, const BinaryString &value)
@@ -351,14 +380,14 @@ void Overlay::store(const BinaryString &key, const BinaryString &value)
 		for(int i=0; i<nodes.size(); ++i)
 		{
 			if(nodes[i] != localNode())
-				sendTo(message, nodes[i]);
+				sendBatched(message, nodes[i]);
 		}
 	}
 }
 
 void Overlay::retrieve(const BinaryString &key)
 {
-	send(Message(Message::Retrieve, "", key));
+	sendRetrieve(key, true);
 
 	// Push Value messages in local queue
 	BinaryString node(localNode());
@@ -387,35 +416,156 @@ bool Overlay::retrieve(const BinaryString &key, Set<BinaryString> &values, durat
 	if(timeout < duration::zero())
 		timeout = milliseconds(Config::Get("request_timeout").toDouble());
 
-  waitConnection(timeout);
+	{
+		std::unique_lock<std::mutex> lock(mRetrieveMutex);
+
+		// Answer locally if the key was recently looked up without success
+		auto it = mRetrieveMisses.find(key);
+		if(it != mRetrieveMisses.end())
+		{
+			if(it->second > Alarm::clock::now())
+			{
+				++mStatistics.cached;
+				lock.unlock();
+				Store::Instance->retrieveValue(key, values);
+				return !values.empty();
+			}
+
+			mRetrieveMisses.erase(it);
+		}
+	}
+
+	waitConnection(timeout);
 
 	std::unique_lock<std::mutex> lock(mRetrieveMutex);
 
+	const Alarm::time_point deadline = Alarm::clock::now() + timeout;
+
 	bool sent = true;
-	if(!mRetrievePending.contains(key))
+	auto it = mRetrieveQueries.find(key);
+	if(it == mRetrieveQueries.end() || it->second.cancelled)
 	{
-		mRetrievePending.insert(key);
-		sent = send(Message(Message::Retrieve, "", key));
+		// A cancelled query still has waiters, it is restarted for them too
+		RetrieveQuery &query = mRetrieveQueries[key];
+		if(it == mRetrieveQueries.end()) query.waiters = 0;
+		query.start = Alarm::clock::now();
+		query.responders.clear();
+		query.cancelled = false;
+		++query.waiters;
+
+		sent = sendRetrieve(key);
+		++mStatistics.lookups;
+	}
+	else {
+		++it->second.waiters;
 	}
 
-	if(sent)
+	// Wait for a quorum of responses, or for the grace period after the first one
+	while(sent)
 	{
-		mRetrieveCondition.wait_for(lock, timeout, [this, key]() {
-			return !mRetrievePending.contains(key);
-		});
+		auto it = mRetrieveQueries.find(key);
+		if(it == mRetrieveQueries.end()) break;	// cancelled
+
+		const RetrieveQuery &query = it->second;
+		if(query.cancelled) break;
+		if(int(query.responders.size()) >= RetrieveQuorum) break;
+
+		Alarm::time_point until = deadline;
+		if(!query.responders.empty()) until = std::min(until, query.first + RetrieveGrace);
+		if(Alarm::clock::now() >= until) break;
+
+		mRetrieveCondition.wait_until(lock, until);
+	}
+
+	it = mRetrieveQueries.find(key);
+	if(it != mRetrieveQueries.end() && --it->second.waiters == 0)
+	{
+		const RetrieveQuery &query = it->second;
+		if(!query.responders.empty())
+		{
+			++mStatistics.hits;
+			mStatistics.addLatency(query.first - query.start);
+		}
+		else if(sent && !query.cancelled) {
+			++mStatistics.misses;
+
+			// Insert in negative cache
+			if(mRetrieveMisses.size() >= MaxNegativeCacheSize)
+			{
+				const Alarm::time_point now = Alarm::clock::now();
+				auto jt = mRetrieveMisses.begin();
+				while(jt != mRetrieveMisses.end())
+				{
+					if(jt->second <= now) mRetrieveMisses.erase(jt++);
+					else ++jt;
+				}
+
+				if(mRetrieveMisses.size() >= MaxNegativeCacheSize)
+					mRetrieveMisses.erase(mRetrieveMisses.begin());
+			}
+
+			mRetrieveMisses.insert(key, Alarm::clock::now() + RetrieveNegativeTimeout);
+		}
+
+		mRetrieveQueries.erase(it);
 	}
 
-	mRetrievePending.erase(key);
+	lock.unlock();
+
 	Store::Instance->retrieveValue(key, values);
 	return !values.empty();
 }
 
+Overlay::Statistics Overlay::statistics(void) const
+{
+	std::unique_lock<std::mutex> lock(mRetrieveMutex);
+	return mStatistics;
+}
+
+bool Overlay::sendRetrieve(const BinaryString &key, bool batched)
+{
+	// Query the closest neighbors in parallel, they will route the request further
+	Array<BinaryString> nodes;
+	if(!getNeighbors(key, RetrieveAlpha, nodes))
+		return false;
+
+	bool success = false;
+	for(int i=0; i<nodes.size(); ++i)
+	{
+		if(batched) success|= sendBatched(Message(Message::Retrieve, "", key), nodes[i]);
+		else success|= sendTo(Message(Message::Retrieve, "", key), nodes[i]);
+	}
+
+	return success;
+}
+
+void Overlay::retrieved(const BinaryString &key, const BinaryString &from)
+{
+	{
+		std::unique_lock<std::mutex> lock(mRetrieveMutex);
+
+		mRetrieveMisses.erase(key);
+
+		auto it = mRetrieveQueries.find(key);
+		if(it == mRetrieveQueries.end() || it->second.cancelled)
+			return;
+
+		RetrieveQuery &query = it->second;
+		if(query.responders.empty())
+			query.first = Alarm::clock::now();
+
+		query.responders.insert(from);
+	}
+
+	mRetrieveCondition.notify_all();
+}
+
 bool Overlay::incoming(Message &message, const BinaryString &from)
 {
 	// Route if necessary
 	if((message.type & 0x80) && !message.destination.empty() && message.destination != localNode())
 	{
-		route(message, from);
+		route(std::move(message), from);
 		return false;
 	}
 
@@ -526,20 +676,12 @@ bool Overlay::incoming(Message &message, const BinaryString &from)
 					for(int i=0; i<nodes.size(); ++i)
 					{
 						if(nodes[i] == localNode()) Store::Instance->storeValue(key, value, Store::Distributed, now);
-						else if(nodes[i] != from) sendTo(message, nodes[i]);
+						else if(nodes[i] != from) sendBatched(message, nodes[i]);
 					}
 				}
 			}
 
-			{
-				std::unique_lock<std::mutex> lock(mRetrieveMutex);
-
-				if(mRetrievePending.contains(key))
-				{
-					mRetrievePending.erase(key);
-					mRetrieveCondition.notify_all();
-				}
-			}
+			retrieved(key, from);
 
 			//push(message);	// useless
 			break;
@@ -559,18 +701,37 @@ bool Overlay::incoming(Message &message, const BinaryString &from)
 
 			Store::Instance->storeValue(key, value, Store::Distributed, Time(ts));
 
-			{
-				std::unique_lock<std::mutex> lock(mRetrieveMutex);
+			retrieved(key, from);
+
+			route(message, from);
+			push(message);
+			break;
+		}
 
-				if(mRetrievePending.contains(key))
+	// Batched Store and Retrieve messages
+	case Message::Batch:
+		{
+			BinaryString content = message.content;
+			uint8_t type, keySize;
+			uint16_t valueSize;
+			while(content.readBinary(type))
+			{
+				BinaryString key, value;
+				if(!content.readBinary(keySize) || !content.readBinary(valueSize)
+					|| content.readBinary(key, keySize) != keySize
+					|| content.readBinary(value, valueSize) != valueSize)
 				{
-					mRetrievePending.erase(key);
-					mRetrieveCondition.notify_all();
+					LogWarn("Overlay::incoming", "Truncated batch message");
+					return false;
 				}
-			}
 
-			route(message, from);
-			push(message);
+				if(type != Message::Store && type != Message::Retrieve)
+					continue;
+
+				Message entry(type, value, key, message.source);
+				entry.ttl = message.ttl;
+				incoming(entry, from);
+			}
 			break;
 		}
 
@@ -593,6 +754,7 @@ bool Overlay::incoming(Message &message, const BinaryString &from)
 	case Message::Call:
 	case Message::Data:
 	case Message::Tunnel:
+	case Message::Mux:
 		{
 			push(message);
 			break;
@@ -612,14 +774,14 @@ bool Overlay::push(Message &message)
 {
 	{
 		std::unique_lock<std::mutex> lock(mIncomingMutex);
-		mIncoming.push(message);
+		mIncoming.push(std::move(message));
 	}
 
 	mIncomingCondition.notify_one();
 	return true;
 }
 
-bool Overlay::route(const Message &message, const BinaryString &from)
+bool Overlay::route(Message message, const BinaryString &from)
 {
 	// Drop if TTL is zero
 	if(message.ttl == 0) return false;
@@ -627,17 +789,16 @@ bool Overlay::route(const Message &message, const BinaryString &from)
 	// Drop if self
 	if(message.destination == localNode()) return false;
 
-	// Drop if not connected
-	if(mHandlers.empty()) return false;
+	// Closest connected neighbors, the first one is the destination if it is a neighbor
+	const int count = 2;
+	Array<BinaryString> neigh;
+	if(!getNeighbors(message.destination, count + 1, neigh))
+		return false;	// not connected
 
 	// Neighbor
-	if(mHandlers.contains(message.destination))
-		return sendTo(message, message.destination);
-
-	Array<BinaryString> neigh;
-	getNeighbors(message.destination, neigh);
+	if(neigh[0] == message.destination)
+		return sendTo(std::move(message), neigh[0]);
 
-	int count = 2;
 	if(neigh.size() >= 2) neigh.remove(from);
 	if(neigh.size() > count) neigh.resize(count);
 
@@ -648,7 +809,7 @@ bool Overlay::route(const Message &message, const BinaryString &from)
 		if(Random().uniform(0, 2) == 0) break;
 	}
 
-	return sendTo(message, route);
+	return sendTo(std::move(message), route);
 }
 
 bool Overlay::broadcast(const Message &message, const BinaryString &from)
@@ -673,7 +834,7 @@ bool Overlay::broadcast(const Message &message, const BinaryString &from)
 	return success;
 }
 
-bool Overlay::sendTo(const Message &message, const BinaryString &to)
+bool Overlay::sendTo(Message message, const BinaryString &to)
 {
 	if(to.empty())
 	{
@@ -685,55 +846,129 @@ bool Overlay::sendTo(const Message &message, const BinaryString &to)
 	if(mHandlers.get(to, handler))
 	{
 		//LogDebug("Overlay::sendTo", "Sending message via " + to.toString());
-		handler->send(message);
+		handler->send(std::move(message));
 		return true;
 	}
 
 	return false;
 }
 
-int Overlay::getRoutes(const BinaryString &destination, int count, Array<BinaryString> &result)
+bool Overlay::sendBatched(const Message &message, const BinaryString &to)
 {
-	result.clear();
+	Assert(message.type == Message::Store || message.type == Message::Retrieve);
 
-	Map<BinaryString, BinaryString> sorted;
-	Array<BinaryString> neighbors;
+	sptr<Handler> handler;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(!mHandlers.get(to, handler))
+			return false;
+	}
+
+	// Older nodes do not understand Batch messages, and large entries are sent as is
+	const int size = int(4 + message.destination.size() + message.content.size());
+	if(handler->version() < 1 || size > MaxBatchSize)
+		return handler->send(message);
 
+	List<Message> full;
+	{
+		std::unique_lock<std::mutex> lock(mBatchMutex);
+
+		auto it = mBatches.find(to);
+		if(it == mBatches.end())
+		{
+			it = mBatches.insert(to, Batch());
+			it->second.size = 0;
+		}
+
+		Batch &batch = it->second;
+		if(!batch.messages.empty() && batch.size + size > MaxBatchSize)
+		{
+			std::swap(full, batch.messages);
+			batch.size = 0;
+		}
+
+		batch.messages.push_back(message);
+		batch.size+= size;
+
+		if(!mBatchAlarm.isScheduled())
+			mBatchAlarm.schedule(BatchDelay);
+	}
+
+	if(!full.empty())
+		return sendBatch(full, to);
+
+	return true;
+}
+
+bool Overlay::sendBatch(const List<Message> &messages, const BinaryString &to)
+{
+	sptr<Handler> handler;
 	{
 		std::unique_lock<std::mutex> lock(mMutex);
-		mHandlers.getKeys(neighbors);
+		if(!mHandlers.get(to, handler))
+			return false;
 	}
 
-	for(int i=0; i<neighbors.size(); ++i)
-		sorted.insert(destination ^ neighbors[i], neighbors[i]);
+	// The handler may have been replaced by one for a connection not confirmed yet
+	if(handler->version() < 1)
+	{
+		for(const Message &message : messages)
+			handler->send(message);
+
+		return true;
+	}
 
-	// local node
-	sorted.insert(destination ^ localNode(), localNode());
+	BinaryString content;
+	for(const Message &message : messages)
+	{
+		content.writeBinary(message.type);
+		content.writeBinary(uint8_t(message.destination.size()));
+		content.writeBinary(uint16_t(message.content.size()));
+		content.writeBinary(message.destination);
+		content.writeBinary(message.content);
+	}
 
-	sorted.getValues(result);
-	if(count > 0 && result.size() > count) result.resize(count);
-	return result.size();
+	return handler->send(Message(Message::Batch, content));
 }
 
-int Overlay::getNeighbors(const BinaryString &destination, Array<BinaryString> &result)
+void Overlay::flushBatches(void)
 {
-	result.clear();
+	Map<BinaryString, Batch> batches;
+	{
+		std::unique_lock<std::mutex> lock(mBatchMutex);
+		std::swap(batches, mBatches);
+	}
 
-	Map<BinaryString, BinaryString> sorted;
-	Array<BinaryString> neighbors;
+	for(auto &p : batches)
+		sendBatch(p.second.messages, p.first);
+}
 
+int Overlay::getRoutes(const BinaryString &destination, int count, Array<BinaryString> &result)
+{
 	{
 		std::unique_lock<std::mutex> lock(mMutex);
-		mHandlers.getKeys(neighbors);
+		mRoutingTable.closest(destination, count, result, true);
 	}
 
-	for(int i=0; i<neighbors.size(); ++i)
-		sorted.insert(destination ^ neighbors[i], neighbors[i]);
+	// Insert local node at its place
+	const BinaryString local = localNode();
+	int i = 0;
+	while(i < result.size() && RoutingTable::IsCloser(result[i], local, destination)) ++i;
+	if(count <= 0 || i < count)
+	{
+		result.insert(result.begin() + i, local);
+		if(count > 0 && result.size() > count) result.resize(count);
+	}
 
-	sorted.getValues(result);
 	return result.size();
 }
 
+int Overlay::getNeighbors(const BinaryString &destination, int count, Array<BinaryString> &result)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mRoutingTable.closest(destination, count, result, true);
+}
+
 void Overlay::registerHandler(const BinaryString &node, const Address &addr, sptr<Overlay::Handler> handler)
 {
 	Assert(handler);
@@ -753,6 +988,7 @@ void Overlay::registerHandler(const BinaryString &node, const Address &addr, spt
 		}
 
 		mHandlers.insert(node, handler);
+		mRoutingTable.insert(node, true);
 		handler->addAddresses(currentAddrs);
 		handler->start();
 
@@ -784,6 +1020,7 @@ void Overlay::unregisterHandler(const BinaryString &node, const Set<Address> &ad
 			return;
 
 		mHandlers.erase(node);
+		mRoutingTable.disconnect(node);
 
 		for(auto &a : addrs)
 			mRemoteAddresses.erase(a);
@@ -796,8 +1033,10 @@ void Overlay::unregisterHandler(const BinaryString &node, const Set<Address> &ad
 	{
 		// Clear pending retrieve requests
 		{
+			// Waiters erase queries themselves
 			std::unique_lock<std::mutex> lock(mRetrieveMutex);
-			mRetrievePending.clear();
+			for(auto it = mRetrieveQueries.begin(); it != mRetrieveQueries.end(); ++it)
+				it->second.cancelled = true;
 		}
 
 		mRetrieveCondition.notify_all();
@@ -931,16 +1170,25 @@ void Overlay::update(void)
 
 		if(connectionsCount() < minConnectionsCount)
 		{
-			Map<Address, BinaryString> peers;
+			// Refresh buckets with unconnected nodes from the routing table, closest first
+			Array<BinaryString> nodes;
+			Map<BinaryString, Set<Address> > peers;
 			{
 				std::unique_lock<std::mutex> lock(mMutex);
+				mRoutingTable.closest(mLocalNode, 0, nodes, false);
 				for(const auto &p : mKnownPeers)
 					if(!mHandlers.contains(p.second))
-						peers.insert(p.first, p.second);
+						peers[p.second].insert(p.first);
 			}
 
-			for(const auto &p : peers)
-				connect(p.first, p.second, mFirstRun);	// async only if first run
+			for(const BinaryString &node : nodes)
+			{
+				if(connectionsCount() >= minConnectionsCount) break;
+
+				auto it = peers.find(node);
+				if(it != peers.end())
+					connect(it->second, node, mFirstRun);	// async only if first run
+			}
 		}
 
 		unsigned count = minConnectionsCount*2;
@@ -1020,6 +1268,221 @@ void Overlay::Message::clear(void)
 	content.clear();
 }
 
+Overlay::RoutingTable::RoutingTable(void)
+{
+
+}
+
+Overlay::RoutingTable::~RoutingTable(void)
+{
+
+}
+
+void Overlay::RoutingTable::init(const BinaryString &local)
+{
+	mLocalNode = local;
+	mBuckets.clear();
+	mBuckets.resize(local.size()*8);
+}
+
+void Overlay::RoutingTable::insert(const BinaryString &node, bool connected)
+{
+	int index = bucketIndex(node);
+	if(index < 0) return;
+
+	List<Entry> &bucket = mBuckets[index];
+	for(auto it = bucket.begin(); it != bucket.end(); ++it)
+	{
+		if(it->node == node)
+		{
+			// Move to the back as most recently seen
+			connected|= it->connected;
+			bucket.erase(it);
+			break;
+		}
+	}
+
+	bucket.push_back(Entry{node, connected});
+
+	// Evict least recently seen unconnected entries if the bucket is full,
+	// connected neighbors are never evicted since they are needed for routing
+	auto it = bucket.begin();
+	while(bucket.size() > BucketSize && it != bucket.end())
+	{
+		if(!it->connected) bucket.erase(it++);
+		else ++it;
+	}
+}
+
+void Overlay::RoutingTable::disconnect(const BinaryString &node)
+{
+	int index = bucketIndex(node);
+	if(index < 0) return;
+
+	for(auto &e : mBuckets[index])
+		if(e.node == node)
+		{
+			e.connected = false;
+			break;
+		}
+}
+
+void Overlay::RoutingTable::erase(const BinaryString &node)
+{
+	int index = bucketIndex(node);
+	if(index < 0) return;
+
+	List<Entry> &bucket = mBuckets[index];
+	for(auto it = bucket.begin(); it != bucket.end(); ++it)
+		if(it->node == node)
+		{
+			bucket.erase(it);
+			break;
+		}
+}
+
+int Overlay::RoutingTable::closest(const BinaryString &target, int count, Array<BinaryString> &result, bool connectedOnly) const
+{
+	// Nodes in the bucket of the target are the closest, then nodes in farther buckets
+	// (all at the same distance order of magnitude), then nodes in closer buckets, by descending index.
+	result.clear();
+	if(mBuckets.empty()) return 0;
+	if(count <= 0) count = std::numeric_limits<int>::max();
+
+	int index = bucketIndex(target);
+	if(index < 0) index = int(mBuckets.size());	// target is local node
+
+	if(index < int(mBuckets.size()))
+	{
+		collect(index, target, result, connectedOnly);
+		if(result.size() >= count)
+		{
+			result.resize(count);
+			return result.size();
+		}
+	}
+
+	size_t offset = result.size();
+	for(int i = index + 1; i < int(mBuckets.size()); ++i)
+		collect(i, target, result, connectedOnly);
+
+	if(result.size() > offset)
+	{
+		std::sort(result.begin() + offset, result.end(), [&target](const BinaryString &a, const BinaryString &b) {
+			return IsCloser(a, b, target);
+		});
+	}
+
+	for(int i = index - 1; i >= 0 && result.size() < count; --i)
+		collect(i, target, result, connectedOnly);
+
+	if(result.size() > count) result.resize(count);
+	return result.size();
+}
+
+bool Overlay::RoutingTable::IsCloser(const BinaryString &a, const BinaryString &b, const BinaryString &target)
+{
+	// Compare XOR distances to target without allocating
+	const size_t size = std::max(std::max(a.size(), b.size()), target.size());
+	for(size_t i = 0; i < size; ++i)
+	{
+		const uint8_t t = (i < target.size() ? uint8_t(target[i]) : 0);
+		const uint8_t da = (i < a.size() ? uint8_t(a[i]) : 0) ^ t;
+		const uint8_t db = (i < b.size() ? uint8_t(b[i]) : 0) ^ t;
+		if(da != db) return da < db;
+	}
+
+	return false;
+}
+
+int Overlay::RoutingTable::bucketIndex(const BinaryString &node) const
+{
+	// Index is the length of the common prefix with the local node
+	const size_t size = std::min(node.size(), mLocalNode.size());
+	for(size_t i = 0; i < size; ++i)
+	{
+		uint8_t d = uint8_t(node[i]) ^ uint8_t(mLocalNode[i]);
+		if(d)
+		{
+			int index = int(i*8);
+			while(!(d & 0x80))
+			{
+				d<<= 1;
+				++index;
+			}
+
+			return index;
+		}
+	}
+
+	return -1;	// local node
+}
+
+void Overlay::RoutingTable::collect(int index, const BinaryString &target, Array<BinaryString> &result, bool connectedOnly) const
+{
+	const size_t offset = result.size();
+	for(const auto &e : mBuckets[index])
+		if(e.connected || !connectedOnly)
+			result.push_back(e.node);
+
+	if(result.size() - offset > 1)
+	{
+		std::sort(result.begin() + offset, result.end(), [&target](const BinaryString &a, const BinaryString &b) {
+			return IsCloser(a, b, target);
+		});
+	}
+}
+
+const double Overlay::Statistics::LatencyBounds[] = { 10., 20., 50., 100., 200., 500., 1000., 2000., 5000., 10000. };
+
+Overlay::Statistics::Statistics(void) :
+	lookups(0),
+	hits(0),
+	misses(0),
+	cached(0)
+{
+	mLatencies.fill(0, sizeof(LatencyBounds)/sizeof(LatencyBounds[0]) + 1);
+}
+
+Overlay::Statistics::~Statistics(void)
+{
+
+}
+
+void Overlay::Statistics::addLatency(duration d)
+{
+	const double ms = milliseconds(d).count();
+
+	int i = 0;
+	while(i < mLatencies.size() - 1 && ms >= LatencyBounds[i]) ++i;
+	++mLatencies[i];
+}
+
+void Overlay::Statistics::serialize(Serializer &s) const
+{
+	// Latency histogram, the last bucket has no upper bound
+	Array<double> bounds;
+	bounds.append(LatencyBounds, mLatencies.size() - 1);
+
+	s << Object()
+		.insert("lookups", lookups)
+		.insert("hits", hits)
+		.insert("misses", misses)
+		.insert("cached", cached)
+		.insert("latency_bounds", bounds)
+		.insert("latencies", mLatencies);
+}
+
+bool Overlay::Statistics::deserialize(Serializer &s)
+{
+	throw Unsupported("Overlay::Statistics::deserialize");
+}
+
+bool Overlay::Statistics::isInlineSerializable(void) const
+{
+	return false;
+}
+
 Overlay::Backend::Backend(Overlay *overlay) :
 	mOverlay(overlay)
 {
@@ -1049,6 +1512,10 @@ bool Overlay::Backend::handshake(SecureTransport *transport, const Address &addr
 	// Add certificate
 	transport->addCredentials(mOverlay->certificate().get(), false);
 
+	// Resume previous session with the same node, or address if node is unknown
+	if(transport->isClient())
+		transport->setSessionKey(!remote.empty() ? remote : BinaryString(addr.toString()));
+
 	// Set verifier
 	MyVerifier verifier;
 	transport->setVerifier(&verifier);
@@ -1376,6 +1843,7 @@ Overlay::Handler::Handler(Overlay *overlay, Stream *stream, const BinaryString &
 	mOverlay(overlay),
 	mStream(stream),
 	mNode(node),
+	mVersion(0),
 	mStop(false),
 	mSender(overlay, stream)
 {
@@ -1435,6 +1903,14 @@ bool Overlay::Handler::recv(Message &message)
 
 			mStream->nextRead();	// switch to next datagram if this is a datagram stream
 
+			{
+				// Older nodes relay the version field unchanged, so only messages originated by the
+				// neighbor itself tell its version, and it is only ever raised for this connection
+				std::unique_lock<std::mutex> lock(mMutex);
+				if(message.source == mNode && message.version > mVersion)
+					mVersion = message.version;
+			}
+
 			if(message.source.empty())	continue;
 			if(message.ttl == 0)		continue;
 			--message.ttl;
@@ -1462,9 +1938,9 @@ bool Overlay::Handler::recv(Message &message)
 	return false;
 }
 
-bool Overlay::Handler::send(const Message &message)
+bool Overlay::Handler::send(Message message)
 {
-	return mSender.push(message);
+	return mSender.push(std::move(message));
 }
 
 void Overlay::Handler::start(void)
@@ -1519,6 +1995,12 @@ BinaryString Overlay::Handler::node(void) const
 	return mNode;
 }
 
+uint8_t Overlay::Handler::version(void) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mVersion;
+}
+
 void Overlay::Handler::run(void)
 {
 	LogDebug("Overlay::Handler::run", "Starting handler");
@@ -1552,13 +2034,13 @@ Overlay::Handler::Sender::~Sender(void)
 
 }
 
-bool Overlay::Handler::Sender::push(const Message &message)
+bool Overlay::Handler::Sender::push(Message message)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
 
 	if(mQueue.size() < Overlay::MaxQueueSize)
 	{
-		mQueue.push(message);
+		mQueue.push(std::move(message));
 		mCondition.notify_all();
 		return true;
 	}
@@ -1611,15 +2093,18 @@ void Overlay::Handler::Sender::run(void)
 
 void Overlay::Handler::Sender::send(const Message &message)
 {
-	BinaryString source = message.source;
-	if(message.source.empty())
-		source = mOverlay->localNode();
+	BinaryString localNode;
+	if(message.source.empty()) localNode = mOverlay->localNode();
+	const BinaryString &source = (!message.source.empty() ? message.source : localNode);
+
+	// The whole message is built in a single reused buffer so it is written at once
+	mBuffer.clear();
+	mBuffer.reserve(8 + source.size() + message.destination.size() + message.content.size());
 
-	BinaryString header;
-	BinarySerializer s(&header);
+	BinarySerializer s(&mBuffer);
 
 	// 32-bit control block
-	s << message.version;
+	s << ProtocolVersion;
 	s << message.flags;
 	s << message.ttl;
 	s << message.type;
@@ -1629,13 +2114,12 @@ void Overlay::Handler::Sender::send(const Message &message)
 	s << uint8_t(message.destination.size());
 	s << uint16_t(message.content.size());
 
-	mStream->writeBinary(header);
-
 	// data
-	mStream->writeBinary(source);
-	mStream->writeBinary(message.destination);
-	mStream->writeBinary(message.content);
+	mBuffer.writeBinary(source);
+	mBuffer.writeBinary(message.destination);
+	mBuffer.writeBinary(message.content);
 
+	mStream->writeBinary(mBuffer);
 	mStream->nextWrite();	// switch to next datagram if this is a datagram stream
 }
 
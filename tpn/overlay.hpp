@@ -52,6 +52,15 @@ public:
 	static const int MaxQueueSize;
 	static const int StoreNeighbors;
 	static const int DefaultTtl;
+	static const int BucketSize;
+	static const int RetrieveAlpha;
+	static const int RetrieveQuorum;
+	static const duration RetrieveGrace;
+	static const duration RetrieveNegativeTimeout;
+	static const int MaxNegativeCacheSize;
+	static const int MaxBatchSize;
+	static const duration BatchDelay;
+	static const uint8_t ProtocolVersion;
 
 	struct Message
 	{
@@ -62,6 +71,7 @@ public:
 		static const uint8_t Retrieve   = 0x03;
 		static const uint8_t Store	= 0x04;
 		static const uint8_t Value	= 0x05;
+		static const uint8_t Batch	= 0x06;	// Batched Store and Retrieve
 
 		// Routable messages
 		static const uint8_t Call	= 0x80|0x01;
@@ -69,14 +79,20 @@ public:
 		static const uint8_t Tunnel	= 0x80|0x03;
 		static const uint8_t Ping	= 0x80|0x04;
 		static const uint8_t Pong	= 0x80|0x05;
+		static const uint8_t Mux	= 0x80|0x06;	// Multiplexed tunnel
 
 		Message(void);
 		Message(uint8_t type,
 			const BinaryString &content = "",
 			const BinaryString &destination = "",
 			const BinaryString &source = "");
+		Message(const Message &message) = default;
+		Message(Message &&message) = default;
 		~Message(void);
 
+		Message &operator=(const Message &message) = default;
+		Message &operator=(Message &&message) = default;
+
 		void clear(void);
 
 		// Fields
@@ -89,6 +105,29 @@ public:
 		BinaryString content;
 	};
 
+	// DHT statistics
+	class Statistics : public Serializable
+	{
+	public:
+		Statistics(void);
+		~Statistics(void);
+
+		void addLatency(duration d);
+
+		void serialize(Serializer &s) const;
+		bool deserialize(Serializer &s);
+		bool isInlineSerializable(void) const;
+
+		uint64_t lookups;	// sent lookups
+		uint64_t hits;		// lookups with at least one response
+		uint64_t misses;	// lookups timed out without response
+		uint64_t cached;	// lookups answered from the negative cache
+
+	private:
+		static const double LatencyBounds[];	// in milliseconds
+		Array<uint64_t> mLatencies;
+	};
+
 	Overlay(int port);
 	~Overlay(void);
 
@@ -119,13 +158,14 @@ public:
 
 	// Message interface
 	bool recv(Message &message, duration timeout);
-	bool send(const Message &message);
+	bool send(Message message);	// pass temporaries to avoid copies
 
 	// DHT
 	void store(const BinaryString &key, const BinaryString &value);
 	void retrieve(const BinaryString &key);					// async
 	bool retrieve(const BinaryString &key, Set<BinaryString> &values);	// sync
 	bool retrieve(const BinaryString &key, Set<BinaryString> &values, duration timeout);
+	Statistics statistics(void) const;
 
 	void serialize(Serializer &s) const;
 	bool deserialize(Serializer &s);
@@ -134,14 +174,49 @@ private:
 	// Routing
 	bool incoming(Message &message, const BinaryString &from);
 	bool push(Message &message);
-	bool route(const Message &message, const BinaryString &from = "");
+	bool route(Message message, const BinaryString &from = "");
 	bool broadcast(const Message &message, const BinaryString &from = "");
-	bool sendTo(const Message &message, const BinaryString &to);
+	bool sendTo(Message message, const BinaryString &to);
+	bool sendBatched(const Message &message, const BinaryString &to);
+	bool sendBatch(const List<Message> &messages, const BinaryString &to);
+	void flushBatches(void);
 	int getRoutes(const BinaryString &destination, int count, Array<BinaryString> &result);
-	int getNeighbors(const BinaryString &destination, Array<BinaryString> &result);
+	int getNeighbors(const BinaryString &destination, int count, Array<BinaryString> &result);
+
+	bool sendRetrieve(const BinaryString &key, bool batched = false);
+	void retrieved(const BinaryString &key, const BinaryString &from);
 
 	void update(void);
 
+	// Kademlia-like routing table with k-buckets indexed by common prefix length
+	class RoutingTable
+	{
+	public:
+		RoutingTable(void);
+		~RoutingTable(void);
+
+		void init(const BinaryString &local);
+		void insert(const BinaryString &node, bool connected);	// moves node to the back of its bucket
+		void disconnect(const BinaryString &node);
+		void erase(const BinaryString &node);
+		int closest(const BinaryString &target, int count, Array<BinaryString> &result, bool connectedOnly = true) const;
+
+		static bool IsCloser(const BinaryString &a, const BinaryString &b, const BinaryString &target);
+
+	private:
+		struct Entry
+		{
+			BinaryString node;
+			bool connected;
+		};
+
+		int bucketIndex(const BinaryString &node) const;
+		void collect(int index, const BinaryString &target, Array<BinaryString> &result, bool connectedOnly) const;
+
+		BinaryString mLocalNode;
+		Array<List<Entry> > mBuckets;
+	};
+
 	class Backend
 	{
 	public:
@@ -201,12 +276,13 @@ private:
 		void stop(void);
 
 		bool recv(Message &message);
-		bool send(const Message &message);
+		bool send(Message message);
 
 		void addAddress(const Address &addr);
 		void addAddresses(const Set<Address> &addrs);
 		void getAddresses(Set<Address> &set) const;
 		BinaryString node(void) const;
+		uint8_t version(void) const;	// remote protocol version
 
 	private:
 		void run(void);
@@ -216,6 +292,7 @@ private:
 		Stream  *mStream;
 		BinaryString mNode;
 		Set<Address> mAddrs;
+		uint8_t mVersion;	// confirmed protocol version of the neighbor
 		bool mStop;
 
 		mutable std::mutex mMutex;
@@ -229,7 +306,7 @@ private:
 			Sender(Overlay *overlay, Stream *stream);
 			~Sender(void);
 
-			bool push(const Message &message);
+			bool push(Message message);
 			void stop(void);
 
 			void run(void);
@@ -240,6 +317,7 @@ private:
 			Overlay *mOverlay;
 			Stream *mStream;
 			Queue<Message> mQueue;
+			BinaryString mBuffer;	// reused for each outgoing message
 			bool mStop;
 
 			mutable std::mutex mMutex;
@@ -267,9 +345,34 @@ private:
 	Map<BinaryString, sptr<Handler> > mHandlers;
 	Set<Address> mRemoteAddresses, mLocalAddresses;
 	Map<Address, BinaryString> mKnownPeers;
+	RoutingTable mRoutingTable;
 
 	Queue<Message> mIncoming;
-	Set<BinaryString> mRetrievePending;
+
+	// Pending DHT lookup
+	struct RetrieveQuery
+	{
+		Alarm::time_point start;
+		Alarm::time_point first;	// time of first response
+		Set<BinaryString> responders;	// distinct nodes which responded
+		unsigned waiters;
+		bool cancelled;
+	};
+
+	Map<BinaryString, RetrieveQuery> mRetrieveQueries;
+	Map<BinaryString, Alarm::time_point> mRetrieveMisses;	// negative cache
+	Statistics mStatistics;
+
+	// Pending Store and Retrieve entries by next hop
+	struct Batch
+	{
+		List<Message> messages;
+		int size;	// size of the serialized entries
+	};
+
+	Map<BinaryString, Batch> mBatches;
+	Alarm mBatchAlarm;
+	mutable std::mutex mBatchMutex;
 
 	Alarm mRunAlarm;
 	bool mFirstRun;
@@ -116,6 +116,7 @@ void Request::addResult(Resource &resource, bool finish)
 	{
 		std::unique_lock<std::mutex> lock(mMutex);
 		mFinished = true;
+		mWaiter.notify();
 	}
 }
 
@@ -129,7 +130,7 @@ void Request::addResult(const Resource::DirectoryRecord &record)
 
 		mResults.append(record);
 		mDigests.insert(record.digest);
-		mCondition.notify_all();
+		mWaiter.notify();
 	}
 }
 
@@ -172,12 +173,12 @@ void Request::http(const String &prefix, Http::Request &request)
 		if(request.get.contains("timeout"))
 			timeout = milliseconds(request.get["timeout"].toDouble());
 
-		mCondition.wait_for(lock, timeout, [this, next]() {
-			return int(mResults.size()) > next || mFinished;
-		});
-
-		// Playlist
-		if(request.get.contains("playlist"))
+		// Park the request until new results arrive or timeout
+		if(int(mResults.size()) <= next && !mFinished && request.park(mWaiter, timeout))
+		{
+			// Response will be sent when resumed
+		}
+		else if(request.get.contains("playlist"))
 		{
 			int start = -1;
 			int stop  = -1;
@@ -74,7 +74,7 @@ private:
 	Alarm mAutoDeleter;
 
 	mutable std::mutex mMutex;
-	mutable std::condition_variable mCondition;
+	Http::Waiter mWaiter;
 };
 
 }
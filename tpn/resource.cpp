@@ -120,7 +120,7 @@ void Resource::process(const String &filename, const Specs &s, bool cache)
 	if(!s.secret.empty())
 	{
 		BinaryString key;
-		Argon2().compute(s.secret, salt, key, 32);
+		Argon2().computeCached(s.secret, salt, key, 32);
 
 		uint64_t i = 0;
 		while(true)
@@ -349,7 +349,7 @@ Resource::Reader::Reader(Resource *resource, const String &secret, bool nocheck)
 		if(!nocheck && mResource->salt().empty())
 			throw Exception("Expected encrypted resource");
 
-		Argon2().compute(secret, mResource->salt(), mKey, 32);
+		Argon2().computeCached(secret, mResource->salt(), mKey, 32);
 	}
 	else {
 		if(!nocheck && !mResource->salt().empty())
@@ -397,6 +397,7 @@ size_t Resource::Reader::readData(char *buffer, size_t size)
 	}
 
 	++mBlockIndex;
+	mPrefetch.erase(mBlocks.front()->digest());
 	mBlocks.pop();
 	fillBlocks();
 
@@ -413,6 +414,8 @@ void Resource::Reader::seekRead(int64_t position)
 	while(!mBlocks.empty())
 		mBlocks.pop();
 
+	mPrefetch.clear();
+
 	size_t offset = 0;
 	mBlockIndex = mResource->blockIndex(position, &offset);
 
@@ -448,6 +451,30 @@ bool Resource::Reader::readDirectory(DirectoryRecord &record)
 	return true;
 }
 
+int64_t Resource::Reader::transfer(Stream &output, int64_t max)
+{
+	if(!mKey.empty()) return read(output, max);	// decryption is required
+
+	int64_t total = 0;
+	while(total < max && !mBlocks.empty())
+	{
+		int64_t size = mBlocks.front()->transfer(output, max - total);
+		if(size > 0)
+		{
+			total+= size;
+			mReadPosition+= size;
+			continue;
+		}
+
+		++mBlockIndex;
+		mPrefetch.erase(mBlocks.front()->digest());
+		mBlocks.pop();
+		fillBlocks();
+	}
+
+	return total;
+}
+
 sptr<Block> Resource::Reader::createBlock(int index)
 {
 	if(index < 0 || index >= mResource->blocksCount()) return NULL;
@@ -467,6 +494,11 @@ void Resource::Reader::fillBlocks(void)
 		sptr<Block> next = createBlock(mBlockIndex + mBlocks.size());
 		if(!next) break;
 		mBlocks.push(next);
+
+		// Call buffered blocks in advance so they are fetched in parallel from different sources
+		BinaryString digest = next->digest();
+		if(!mResource->mLocalOnly && !mPrefetch.contains(digest) && !next->isLocallyAvailable())
+			mPrefetch.insert(digest, std::make_shared<Network::Caller>(digest));
 	}
 }
 
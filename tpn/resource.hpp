@@ -149,6 +149,7 @@ public:
 		int64_t tellWrite(void) const;
 
 		bool readDirectory(DirectoryRecord &record);
+		int64_t transfer(Stream &output, int64_t max);	// zero-copy from cache files if possible
 
 	private:
 		sptr<Block> createBlock(int index);
@@ -159,6 +160,7 @@ public:
 
 		int mBlockIndex, mBufferedCount;
 		Queue<sptr<Block> > mBlocks;
+		Map<BinaryString, sptr<Network::Caller> > mPrefetch;	// callers for buffered blocks
 
 		BinaryString mKey;
 	};
@@ -32,6 +32,13 @@ namespace tpn
 {
 
 Store *Store::Instance = NULL;
+Budget::Account Store::SinkAccount("store");
+const unsigned Store::MaxSinks = 256;
+const unsigned Store::MaxSinksPerSource = 32;
+const duration Store::SinkTimeout = seconds(300.);		// 5 min
+const duration Store::SpilledSinkTimeout = seconds(3600.);	// 1h
+const unsigned Store::MaxSpilledSinks = 1024;
+const int64_t Store::MaxSpilledSize = 256*1024*1024;	// 256 MiB
 
 BinaryString Store::Hash(const String &str)
 {
@@ -39,6 +46,7 @@ BinaryString Store::Hash(const String &str)
 }
 
 Store::Store(void) :
+	mSpilledSize(0),
 	mRunning(false)
 {
 	mDatabase = new Database("store.db");
@@ -64,6 +72,18 @@ Store::Store(void) :
 		type INTEGER(1))");
 	mDatabase->execute("CREATE UNIQUE INDEX IF NOT EXISTS pair ON map (key, value)");
 	mDatabase->execute("CREATE INDEX IF NOT EXISTS type ON map (time, type)");
+
+	// Spilled sinks are not tracked across restarts
+	try {
+		Directory dir(Config::Get("cache_dir"));
+		while(dir.nextFile())
+			if(!dir.fileIsDirectory() && dir.fileName().afterLast('.') == "partial")
+				File::Remove(dir.filePath());
+	}
+	catch(const Exception &e)
+	{
+		LogWarn("Store", String("Unable to remove spilled sinks: ") + e.what());
+	}
 }
 
 Store::~Store(void)
@@ -71,7 +91,7 @@ Store::~Store(void)
 
 }
 
-bool Store::push(const BinaryString &digest, Fountain::Combination &input)
+bool Store::push(const BinaryString &digest, Fountain::Combination &input, const BinaryString &source)
 {
 	sptr<Sink> sink;
 	{
@@ -82,8 +102,8 @@ bool Store::push(const BinaryString &digest, Fountain::Combination &input)
 		mSinks.get(digest, sink);
 		if(!sink)
 		{
-			sink = std::make_shared<Sink>(digest);
-			mSinks.insert(digest, sink);
+			sink = createSink(digest, source);
+			if(!sink) return false;
 		}
 	}
 
@@ -102,6 +122,164 @@ bool Store::push(const BinaryString &digest, Fountain::Combination &input)
 	return false;
 }
 
+sptr<Store::Sink> Store::createSink(const BinaryString &digest, const BinaryString &source)
+{
+	// Must be called with mMutex locked
+	expireSinks();
+
+	// A source only competes with itself for its quota
+	if(!source.empty())
+	{
+		unsigned count = 0;
+		for(auto it = mSinks.begin(); it != mSinks.end(); ++it)
+			if(it->second->source() == source)
+				++count;
+
+		if(count >= MaxSinksPerSource)
+			evictOldestSink(source);
+	}
+
+	while(mSinks.size() >= MaxSinks)
+		evictOldestSink();
+
+	// Make room when memory is exhausted, but don't start decoding if it doesn't help
+	if(SinkAccount.isExhausted() && (!evictOldestSink() || SinkAccount.isExhausted()))
+		return NULL;
+
+	sptr<Sink> sink = std::make_shared<Sink>(digest, source);
+
+	if(mSpilledSinks.contains(digest))
+	{
+		if(!sink->restore(spilledPath(digest)))
+			LogDebug("Store::createSink", "Unable to restore spilled sink for " + digest.toString());
+
+		removeSpilledSink(digest);
+	}
+
+	mSinks.insert(digest, sink);
+	return sink;
+}
+
+void Store::evictSink(const BinaryString &digest)
+{
+	// Must be called with mMutex locked
+	sptr<Sink> sink;
+	if(!mSinks.get(digest, sink)) return;
+	mSinks.erase(digest);
+
+	// Only blocks still being called are worth resuming
+	if(Config::Get("store_spill_sinks").toBool() && mCalled.contains(digest))
+	{
+		String filename = spilledPath(digest);
+		if(sink->spill(filename))
+		{
+			removeSpilledSink(digest);
+
+			SpilledSink spilled;
+			spilled.lastUsed = Time::Now();
+			spilled.size = int64_t(File::Size(filename));
+			mSpilledSinks.insert(digest, spilled);
+			mSpilledSize+= spilled.size;
+
+			while(mSpilledSinks.size() > MaxSpilledSinks || mSpilledSize > MaxSpilledSize)
+				removeOldestSpilledSink();
+
+			return;
+		}
+
+		File::Remove(filename);
+	}
+
+	sink->evict();
+}
+
+bool Store::evictOldestSink(const BinaryString &source)
+{
+	// Must be called with mMutex locked
+	BinaryString oldest;
+	Time oldestTime;
+	for(auto it = mSinks.begin(); it != mSinks.end(); ++it)
+	{
+		if(!source.empty() && it->second->source() != source)
+			continue;
+
+		Time t = it->second->lastUsed();
+		if(oldest.empty() || t < oldestTime)
+		{
+			oldest = it->first;
+			oldestTime = t;
+		}
+	}
+
+	if(oldest.empty()) return false;
+
+	LogDebug("Store::evictOldestSink", "Evicting sink for " + oldest.toString());
+	evictSink(oldest);
+	return true;
+}
+
+void Store::expireSinks(void)
+{
+	// Must be called with mMutex locked
+	Time now = Time::Now();
+
+	auto it = mSinks.begin();
+	while(it != mSinks.end())
+	{
+		if(now - it->second->lastUsed() >= SinkTimeout)
+		{
+			it->second->evict();
+			mSinks.erase(it++);
+		}
+		else ++it;
+	}
+
+	List<BinaryString> expired;
+	for(auto jt = mSpilledSinks.begin(); jt != mSpilledSinks.end(); ++jt)
+		if(now - jt->second.lastUsed >= SpilledSinkTimeout)
+			expired.push_back(jt->first);
+
+	for(const BinaryString &digest : expired)
+		removeSpilledSink(digest);
+}
+
+void Store::removeSpilledSink(const BinaryString &digest)
+{
+	// Must be called with mMutex locked
+	auto it = mSpilledSinks.find(digest);
+	if(it == mSpilledSinks.end()) return;
+
+	mSpilledSize-= it->second.size;
+	mSpilledSinks.erase(it);
+	File::Remove(spilledPath(digest));
+}
+
+bool Store::removeOldestSpilledSink(void)
+{
+	// Must be called with mMutex locked
+	BinaryString oldest;
+	Time oldestTime;
+	for(auto it = mSpilledSinks.begin(); it != mSpilledSinks.end(); ++it)
+	{
+		if(oldest.empty() || it->second.lastUsed < oldestTime)
+		{
+			oldest = it->first;
+			oldestTime = it->second.lastUsed;
+		}
+	}
+
+	if(oldest.empty()) return false;
+
+	LogDebug("Store::removeOldestSpilledSink", "Removing spilled sink for " + oldest.toString());
+	removeSpilledSink(oldest);
+	return true;
+}
+
+String Store::spilledPath(const BinaryString &digest) const
+{
+	return Cache::Instance->path(digest) + ".partial";
+}
+
 bool Store::pull(const BinaryString &digest, Fountain::Combination &output, unsigned *rank)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
@@ -127,6 +305,19 @@ unsigned Store::missing(const BinaryString &digest)
 	else return Block::MaxChunks;
 }
 
+void Store::setCalled(const BinaryString &digest, bool called)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	if(called)
+	{
+		mCalled.insert(digest);
+	}
+	else {
+		mCalled.erase(digest);
+		removeSpilledSink(digest);
+	}
+}
+
 bool Store::hasBlock(const BinaryString &digest)
 {
 	Database::Statement statement = mDatabase->prepare("SELECT f.name FROM blocks b LEFT JOIN files f ON f.id = b.file_id WHERE b.digest = ?1");
@@ -402,9 +593,9 @@ void Store::run(void)
 {
 	const duration maxAge = seconds(Config::Get("store_max_age").toDouble());
 
-	// TODO: delay and batch values
+	// Values are coalesced per next hop by the overlay
 	const duration delay = seconds(1.);
-	const int batch = 10;
+	const int batch = 100;
 
 	LogDebug("Store::run", "Started");
 
@@ -415,6 +606,11 @@ void Store::run(void)
 		int offset = 0;
 		while(true)
 		{
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				expireSinks();
+			}
+
 			if(Network::Instance->overlay()->connectionsCount() == 0)
 			{
 				LogDebug("Store::run", "Interrupted");
@@ -461,23 +657,42 @@ void Store::run(void)
 	}
 }
 
-Store::Sink::Sink(const BinaryString &digest) :
+Store::Sink::Sink(const BinaryString &digest, const BinaryString &source) :
 	mDigest(digest),
-	mSize(0)
+	mSource(source),
+	mSize(0),
+	mAccounted(0),
+	mLastUsed(Time::Now()),
+	mEvicted(false)
 {
 
 }
 
 Store::Sink::~Sink(void)
 {
-
+	release();
 }
 
 bool Store::Sink::push(Fountain::Combination &incoming)
 {
 	std::unique_lock<std::mutex> lock(mMutex);
 
+	if(mEvicted) return false;
+	mLastUsed = Time::Now();
+
+	// Reserve room for the combination, then account for what the sink actually kept
+	if(!SinkAccount.acquire(Fountain::ChunkSize)) return false;
+	mAccounted+= Fountain::ChunkSize;
+
 	mSink.solve(incoming);
+
+	uint64_t held = uint64_t(mSink.rank())*Fountain::ChunkSize;
+	if(held < mAccounted)
+	{
+		SinkAccount.release(mAccounted - held);
+		mAccounted = held;
+	}
+
 	if(!mSink.isDecoded()) return false;
 
 	BinaryString sinkDigest;
@@ -518,4 +733,72 @@ int64_t Store::Sink::size(void) const
 	return mSize;
 }
 
+BinaryString Store::Sink::source(void) const
+{
+	return mSource;
+}
+
+Time Store::Sink::lastUsed(void) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mLastUsed;
+}
+
+bool Store::Sink::spill(const String &filename)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	try {
+		File file(filename, File::Write);
+		mSink.save(file);
+		file.close();
+	}
+	catch(const Exception &e)
+	{
+		LogWarn("Store::Sink::spill", e.what());
+		return false;
+	}
+
+	mEvicted = true;
+	mSink.clear();
+	release();
+	return true;
+}
+
+bool Store::Sink::restore(const String &filename)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	try {
+		File file(filename, File::Read);
+		if(!mSink.load(file)) return false;
+	}
+	catch(const Exception &e)
+	{
+		mSink.clear();
+		return false;
+	}
+
+	// Restored state is charged, it was already accepted once
+	uint64_t held = uint64_t(mSink.rank())*Fountain::ChunkSize;
+	SinkAccount.charge(held);
+	mAccounted+= held;
+	return true;
+}
+
+void Store::Sink::evict(void)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mEvicted = true;
+	mSink.clear();
+	release();
+}
+
+void Store::Sink::release(void)
+{
+	// Must be called with mMutex locked, or from the destructor
+	SinkAccount.release(mAccounted);
+	mAccounted = 0;
+}
+
 }
@@ -32,6 +32,7 @@
 #include "pla/list.hpp"
 #include "pla/set.hpp"
 #include "pla/binarystring.hpp"
+#include "pla/budget.hpp"
 
 namespace tpn
 {
@@ -40,14 +41,22 @@ class Store
 {
 public:
 	static Store *Instance;
+	static Budget::Account SinkAccount;	// bytes held by partially decoded blocks
+	static const unsigned MaxSinks;			// partially decoded blocks in memory
+	static const unsigned MaxSinksPerSource;
+	static const duration SinkTimeout;		// idle time before a sink is dropped
+	static const duration SpilledSinkTimeout;	// idle time before a spilled sink is dropped
+	static const unsigned MaxSpilledSinks;
+	static const int64_t MaxSpilledSize;		// bytes of spilled sinks on disk
 	static BinaryString Hash(const String &str);
 
 	Store(void);
 	~Store(void);
 
-	bool push(const BinaryString &digest, Fountain::Combination &input);
+	bool push(const BinaryString &digest, Fountain::Combination &input, const BinaryString &source = "");
 	bool pull(const BinaryString &digest, Fountain::Combination &output, unsigned *rank = NULL);
 	unsigned missing(const BinaryString &digest);
+	void setCalled(const BinaryString &digest, bool called);	// sinks are spilled only for called blocks
 
 	bool hasBlock(const BinaryString &digest);
 	void waitBlock(const BinaryString &digest);
@@ -82,7 +91,7 @@ private:
 	class Sink
 	{
 	public:
-		Sink(const BinaryString &digest = "");
+		Sink(const BinaryString &digest = "", const BinaryString &source = "");
 		~Sink(void);
 
 		bool push(Fountain::Combination &incoming);
@@ -90,18 +99,48 @@ private:
 
 		String path(void) const;
 		int64_t size(void) const;
+		BinaryString source(void) const;
+		Time lastUsed(void) const;
+
+		bool spill(const String &filename);	// save state to file and free memory
+		bool restore(const String &filename);
+		void evict(void);			// further combinations are ignored
 
 	private:
+		void release(void);
+
 		Fountain::Sink mSink;
 		BinaryString mDigest;
+		BinaryString mSource;
 		String mPath;
 		int64_t mSize;
+		uint64_t mAccounted;	// bytes acquired from SinkAccount
+		Time mLastUsed;
+		bool mEvicted;
 
 		mutable std::mutex mMutex;
 	};
 
+	// Must be called with mMutex locked
+	sptr<Sink> createSink(const BinaryString &digest, const BinaryString &source);
+	void evictSink(const BinaryString &digest);
+	bool evictOldestSink(const BinaryString &source = "");
+	void expireSinks(void);
+	void removeSpilledSink(const BinaryString &digest);
+	bool removeOldestSpilledSink(void);
+	String spilledPath(const BinaryString &digest) const;
+
+	struct SpilledSink
+	{
+		Time lastUsed;
+		int64_t size;
+	};
+
 	Database *mDatabase;
 	Map<BinaryString,sptr<Sink> > mSinks;
+	Map<BinaryString,SpilledSink> mSpilledSinks;	// sinks saved to disk
+	Set<BinaryString> mCalled;
+	int64_t mSpilledSize;
 	bool mRunning;
 
 	mutable std::mutex mMutex;
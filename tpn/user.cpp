@@ -282,12 +282,12 @@ void User::send(const String &password) const
 
 bool User::authenticate(const String &name, const String &password) const
 {
-	std::unique_lock<std::mutex> lock(mMutex);
-
+	// Derive outside the lock, repeated requests hit the cache
 	BinaryString salt = String("teapotnet:") + name;
 	BinaryString digest;
-	Argon2().compute(password, salt, digest, 32);
+	Argon2().computeCached(password, salt, digest, 32);
 
+	std::unique_lock<std::mutex> lock(mMutex);
 	return mAuthDigest == digest;
 }
 